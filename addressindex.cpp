@@ -0,0 +1,77 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "addressindex.h"
+
+#include <algorithm>
+
+void AddressIndex::build(const QVector<Block> &blocks, const QList<StructLayout> &layouts)
+{
+    QVector<int> order;
+    order.reserve(blocks.length());
+    for (int i = 0; i < blocks.length(); i++) {
+        if (blocks[i].oldMemoryAddress && blocks[i].size) {
+            order.append(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&blocks](int a, int b) {
+        return blocks[a].oldMemoryAddress < blocks[b].oldMemoryAddress;
+    });
+
+    m_begin.resize(order.size());
+    m_end.resize(order.size());
+    m_block.resize(order.size());
+    m_elementSize.resize(order.size());
+    for (int i = 0; i < order.size(); i++) {
+        const Block &block = blocks[order[i]];
+        m_begin[i] = block.oldMemoryAddress;
+        m_end[i] = block.oldMemoryAddress + block.size;
+        m_block[i] = block.index;
+        // Single structures are addressed by offset only
+        m_elementSize[i] = block.count != 1 ? layouts.at(block.sdnaIndex).size : 0;
+    }
+}
+
+bool AddressIndex::find(uint64_t address, Target &target) const
+{
+    int n = m_begin.size();
+    if (!n) {
+        return false;
+    }
+
+    // Last range that starts at or before address
+    const uint64_t *base = m_begin.constData();
+    while (n > 1) {
+        int half = n / 2;
+        base = base[half] <= address ? base + half : base;
+        n -= half;
+    }
+    int i = static_cast<int>(base - m_begin.constData());
+    if (address < m_begin[i] || address >= m_end[i]) {
+        return false;
+    }
+
+    uint64_t offset = address - m_begin[i];
+    uint32_t size = m_elementSize[i];
+    target.block = m_block[i];
+    target.array = size != 0;
+    target.element = size ? static_cast<uint32_t>(offset / size) : 0;
+    target.offset = size ? offset % size : offset;
+    return true;
+}
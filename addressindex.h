@@ -0,0 +1,56 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef ADDRESSINDEX_H
+#define ADDRESSINDEX_H
+
+#include <inttypes.h>
+
+#include <QList>
+#include <QVector>
+
+#include "blendfile.h"
+
+/*
+ * Maps old memory addresses to the block that contained them when the
+ * file was saved. The ranges are kept sorted in flat arrays, so a lookup
+ * is a branchless binary search over contiguous start addresses.
+ */
+class AddressIndex
+{
+public:
+    struct Target
+    {
+        uint32_t block;     // position of the block in the file
+        bool array;         // the block holds more than one structure
+        uint32_t element;   // element within the block
+        uint64_t offset;    // byte offset within the element
+    };
+
+    void build(const QVector<Block> &blocks, const QList<StructLayout> &layouts);
+    bool find(uint64_t address, Target &target) const;
+
+private:
+    QVector<uint64_t> m_begin;
+    QVector<uint64_t> m_end;
+    QVector<uint32_t> m_block;
+    QVector<uint32_t> m_elementSize;
+};
+
+#endif // ADDRESSINDEX_H
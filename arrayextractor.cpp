@@ -0,0 +1,207 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "arrayextractor.h"
+#include "blenderror.h"
+
+#include <cstring>
+#include <QIODevice>
+#include <QStringList>
+
+// Byte order mark of multi-byte .npy types, the host's
+static const char HostOrder = Q_BYTE_ORDER == Q_BIG_ENDIAN ? '>' : '<';
+
+// Bytes of field values gathered before they are written
+static const uint32_t BatchSize = 1 << 20;
+
+// Converts count values in place from the byte order of the file
+template<typename T>
+static void toHostOrder(bool bigEndian, char *data, qsizetype count)
+{
+    if (bigEndian) {
+        qFromBigEndian<T>(data, count, data);
+    } else {
+        qFromLittleEndian<T>(data, count, data);
+    }
+}
+
+quint64 ArrayExtractor::extract(const QString &path, QIODevice *out)
+{
+    QStringList parts = path.split('.');
+    if (parts.length() < 2) {
+        blendError("Expected a structure and a field, e.g. MVert.co: %s", qPrintable(path));
+    }
+    const uint32_t structure = m_file.structureIndex(parts.first());
+    if (structure == BlendFile::NOTYPE) {
+        blendError("Unknown structure %s", qPrintable(parts.first()));
+    }
+
+    // Nested structures only add their offset
+    uint32_t current = structure;
+    uint32_t offset = 0;
+    FieldLayout field;
+    for (int i = 1; i < parts.length(); i++) {
+        int index = m_file.fieldIndex(current, parts[i].toUtf8());
+        if (index < 0) {
+            blendError("No field %s in %s", qPrintable(parts[i]), m_file.layouts().at(current).tag.constData());
+        }
+        field = m_file.layouts().at(current).fields.at(index);
+        offset += field.offset;
+        if (i + 1 < parts.length()) {
+            if (field.kind != FieldLayout::Struct || field.width * field.height != 1) {
+                blendError("%s is not a single structure", qPrintable(QStringList(parts.mid(0, i + 1)).join('.')));
+            }
+            current = field.structure;
+        }
+    }
+    if (field.kind == FieldLayout::Struct || field.kind == FieldLayout::Empty) {
+        blendError("%s is a structure, extract one of its fields", qPrintable(path));
+    }
+
+    const uint32_t stride = m_file.layouts().at(structure).size;
+    quint64 count = 0;
+    for (const Block &block : m_file.blocks()) {
+        if (block.sdnaIndex == structure) {
+            count += m_file.elementCount(block);
+        }
+    }
+
+    // Chars are byte strings of the last dimension
+    QList<quint64> shape;
+    shape << count;
+    if (field.kind == FieldLayout::Char) {
+        if (field.height > 1) {
+            shape << field.width;
+        }
+    } else if (field.width * field.height > 1) {
+        shape << field.width;
+        if (field.height > 1) {
+            shape << field.height;
+        }
+    }
+    QByteArray header = npyHeader(descr(field), shape);
+    write(out, header.constData(), header.size());
+
+    const uint32_t valueSize = field.kind == FieldLayout::Char ? 1 : field.size / (field.width * field.height);
+    const bool swap = valueSize > 1 && m_file.isBigEndian() != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+
+    QByteArray values;
+    for (const Block &block : m_file.blocks()) {
+        if (block.sdnaIndex != structure) {
+            continue;
+        }
+        const uint32_t elements = m_file.elementCount(block);
+        QByteArray data = m_file.blockData(block);
+        if (static_cast<quint64>(data.size()) < static_cast<quint64>(elements) * stride) {
+            blendError("Block %s is truncated", qPrintable(QString(block.name())));
+        }
+
+        // A field that fills its structure is already a contiguous array
+        if (field.size == stride && !swap) {
+            write(out, data.constData(), static_cast<qint64>(elements) * stride);
+            continue;
+        }
+
+        // Gathered in batches, so the buffer stays small however large the block
+        const uint32_t batch = qMax<uint32_t>(1, BatchSize / qMax<uint32_t>(field.size, 1));
+        const char *src = data.constData() + offset;
+        for (uint32_t first = 0; first < elements; first += batch) {
+            const uint32_t n = qMin(batch, elements - first);
+            values.resize(static_cast<int>(static_cast<qint64>(n) * field.size));
+            char *dest = values.data();
+            for (uint32_t i = 0; i < n; i++) {
+                memcpy(dest, src, field.size);
+                src += stride;
+                dest += field.size;
+            }
+
+            if (swap) {
+                const qsizetype count = values.size() / valueSize;
+                switch (valueSize) {
+                case 2: toHostOrder<quint16>(m_file.isBigEndian(), values.data(), count); break;
+                case 4: toHostOrder<quint32>(m_file.isBigEndian(), values.data(), count); break;
+                case 8: toHostOrder<quint64>(m_file.isBigEndian(), values.data(), count); break;
+                }
+            }
+            write(out, values.constData(), values.size());
+        }
+    }
+    return count;
+}
+
+/*
+ * Format version 1.0: magic, version, the length of the header and a
+ * Python dict literal, padded with spaces to a multiple of 64 bytes.
+ */
+QByteArray ArrayExtractor::npyHeader(const QByteArray &descr, const QList<quint64> &shape)
+{
+    // A tuple with one element needs its trailing comma
+    QByteArray dims;
+    for (int i = 0; i < shape.length(); i++) {
+        dims += (i ? ", " : "") + QByteArray::number(shape[i]);
+    }
+    if (shape.length() == 1) {
+        dims += ',';
+    }
+
+    QByteArray dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (" + dims + "), }";
+    const int prefix = 10;
+    const int padding = 63 - (prefix + dict.size()) % 64;
+    dict.append(QByteArray(padding, ' '));
+    dict.append('\n');
+
+    QByteArray header("\x93NUMPY\x01\x00", 8);
+    header.append(static_cast<char>(dict.size() & 0xFF));
+    header.append(static_cast<char>(dict.size() >> 8));
+    header.append(dict);
+    return header;
+}
+
+QByteArray ArrayExtractor::descr(const FieldLayout &field) const
+{
+    const bool isUnsigned = m_file.typeNames().at(field.type).startsWith(QLatin1String("u"));
+    const QByteArray order(1, HostOrder);
+    switch (field.kind) {
+    case FieldLayout::Char:
+        return "|S" + QByteArray::number(field.height > 1 ? field.height : field.width);
+    case FieldLayout::Int8:
+        return isUnsigned ? "|u1" : "|i1";
+    case FieldLayout::Int16:
+        return order + (isUnsigned ? "u2" : "i2");
+    case FieldLayout::Int32:
+        return order + (isUnsigned ? "u4" : "i4");
+    case FieldLayout::Int64:
+        return order + (isUnsigned ? "u8" : "i8");
+    case FieldLayout::Float:
+        return order + "f4";
+    case FieldLayout::Double:
+        return order + "f8";
+    case FieldLayout::Pointer:
+        return order + (m_file.pointerSize() == 4 ? "u4" : "u8");
+    default:
+        return QByteArray();
+    }
+}
+
+void ArrayExtractor::write(QIODevice *out, const char *data, qint64 len)
+{
+    if (out->write(data, len) != len) {
+        blendError("Cannot write array: %s", qPrintable(out->errorString()));
+    }
+}
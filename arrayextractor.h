@@ -0,0 +1,59 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef ARRAYEXTRACTOR_H
+#define ARRAYEXTRACTOR_H
+
+#include <inttypes.h>
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+#include "blendfile.h"
+
+class QIODevice;
+
+/*
+ * Writes one field of every element of a structure type, e.g. MVert.co,
+ * as a single NumPy .npy array. The field is copied straight out of the
+ * block data using its SDNA offset; values are only byte swapped when the
+ * file was written with the other byte order than the host's.
+ */
+class ArrayExtractor
+{
+public:
+    explicit ArrayExtractor(const BlendFile &file) : m_file(file) {}
+
+    // Writes the field at path, a structure type followed by field names
+    // ("Object.id.name"), and returns the number of elements. Throws
+    // BlendError if the path does not name a number, pointer or char field.
+    quint64 extract(const QString &path, QIODevice *out);
+
+    // .npy file header for an array of descr values with the given shape
+    static QByteArray npyHeader(const QByteArray &descr, const QList<quint64> &shape);
+
+private:
+    const BlendFile &m_file;
+
+    QByteArray descr(const FieldLayout &field) const;
+    void write(QIODevice *out, const char *data, qint64 len);
+};
+
+#endif // ARRAYEXTRACTOR_H
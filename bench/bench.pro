@@ -0,0 +1,9 @@
+TARGET = blend2xml-bench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+SOURCES += main.cpp blendgenerator.cpp
+HEADERS += blendgenerator.h
+
+include(../blend2xml.pri)
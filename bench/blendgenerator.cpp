@@ -0,0 +1,365 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "blendgenerator.h"
+
+#include <cmath>
+#include <cstring>
+#include <QtEndian>
+
+BlendGenerator::BlendGenerator(int pointerSize, bool bigEndian, int depth, int arraySize, bool textSamples)
+    : pointerSize(pointerSize), bigEndian(bigEndian), textSamples(textSamples)
+{
+    typenames << "char" << "short" << "int" << "float" << "double" << "uint64_t" << "void";
+    typelengths << 1 << 2 << 4 << 4 << 8 << 8 << 0;
+
+    QByteArray array = "[" + QByteArray::number(arraySize) + "]";
+
+    addStructure("Link", QList<FieldDef>()
+                 << field("Link", "*next")
+                 << field("Link", "*prev"));
+    addStructure("ID", QList<FieldDef>()
+                 << field("void", "*next")
+                 << field("void", "*prev")
+                 << field("char", "name[66]", 66)
+                 << field("short", "flag")
+                 << field("int", "us"));
+    QList<FieldDef> leaf;
+    leaf << field("Link", "link")
+         << field("float", "co" + array, arraySize)
+         << field("short", "no[3]", 3)
+         << field("int", "flag")
+         << field("char", "name[32]", 32)
+         << field("double", "weight")
+         << field("uint64_t", "session_uid")
+         << field("void", "*data");
+    if (textSamples) {
+        // Escaped as text if they are not plain, hex data and rows of text
+        leaf << field("char", "label_str[20]", 20)
+             << field("char", "buffer[40]", 40)
+             << field("char", "lines[3][24]", 72);
+    }
+    addStructure("Leaf", leaf);
+
+    for (int level = 1; level <= depth; level++) {
+        QByteArray type = "Node" + QByteArray::number(level);
+        QList<FieldDef> fields;
+        if (level == 1) {
+            fields << field("ID", "id") << field("Leaf", "leaf");
+        } else {
+            fields << field("Node" + QByteArray::number(level - 1), "child");
+        }
+        fields << field(type, "*next")
+               << field("int", "values" + array, arraySize)
+               << field("float", "matrix[4][4]", 16);
+        addStructure(type, fields);
+    }
+}
+
+/*
+ * Builds a file with the given number of blocks of the given number of
+ * elements each. Blocks cycle through Leaf and the Node structures; the
+ * outermost Node is stored as an ID block like objects in Blender files.
+ */
+QByteArray BlendGenerator::generate(int blocks, int elements) const
+{
+    int first = structureIndex(typenames.indexOf("Leaf"));
+    int kinds = structures.length() - first;
+
+    QList<uint64_t> addresses;
+    uint64_t address = pointerSize == 8 ? Q_UINT64_C(0x7f0000000000) : Q_UINT64_C(0x10000000);
+    for (int i = 0; i < blocks; i++) {
+        const StructDef &structure = structures[first + i % kinds];
+        addresses.append(address);
+        address += (static_cast<uint64_t>(typelengths[structure.type]) * elements + 0x4f) & ~Q_UINT64_C(0xf);
+    }
+
+    QByteArray data("BLENDER");
+    data.append(pointerSize == 8 ? '-' : '_');
+    data.append(bigEndian ? 'V' : 'v');
+    data.append("280");
+
+    for (int i = 0; i < blocks; i++) {
+        int index = first + i % kinds;
+        uint32_t length = static_cast<uint32_t>(typelengths[structures[index].type]);
+        const char *code = index == structures.length() - 1 && index != first ? "OB\0\0" : "DATA";
+        appendBlockHeader(data, code, length * elements, addresses[i], index, elements);
+
+        int pos = data.size();
+        data.resize(pos + static_cast<int>(length) * elements);
+        for (int e = 0; e < elements; e++) {
+            fill(data.data() + pos + e * length, index, static_cast<uint32_t>(i * elements + e), addresses);
+        }
+    }
+
+    QByteArray sdna = dna();
+    appendBlockHeader(data, "DNA1", sdna.size(), address, 0, 1);
+    data.append(sdna);
+    appendBlockHeader(data, "ENDB", 0, 0, 0, 0);
+    return data;
+}
+
+void BlendGenerator::addStructure(const QByteArray &type, QList<FieldDef> fields)
+{
+    // Added first, structures may point to themselves
+    StructDef structure;
+    structure.type = typenames.length();
+    typenames.append(type);
+
+    int length = 0;
+    for (FieldDef &field : fields) {
+        field.type = typenames.indexOf(field.typeName);
+        length += (field.isPointer ? pointerSize : typelengths[field.type]) * field.count;
+        if (!names.contains(field.name)) {
+            names.append(field.name);
+        }
+    }
+    typelengths.append(length);
+
+    structure.fields = fields;
+    structures.append(structure);
+}
+
+BlendGenerator::FieldDef BlendGenerator::field(const QByteArray &type, const QByteArray &name, int count) const
+{
+    FieldDef field;
+    field.typeName = type;
+    field.type = -1;
+    field.name = name;
+    field.isPointer = name.startsWith('*');
+    field.count = count;
+    return field;
+}
+
+int BlendGenerator::structureIndex(int type) const
+{
+    for (int i = 0; i < structures.length(); i++) {
+        if (structures[i].type == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Fills one element with values that look like real data: increasing
+ * counters, smooth coordinates, names and pointers into other blocks.
+ */
+void BlendGenerator::fill(char *dest, int structure, uint32_t seed, const QList<uint64_t> &addresses) const
+{
+    uint32_t pointers = 0;
+    for (const FieldDef &field : structures[structure].fields) {
+        if (field.isPointer) {
+            for (int i = 0; i < field.count; i++, dest += pointerSize, pointers++) {
+                uint32_t target = (seed * 2654435761u + pointers * 40503u) % addresses.length();
+                uint64_t address = (seed + pointers) % 5 == 0 ? 0 : addresses[target];
+                if (pointerSize == 8) {
+                    store<quint64>(dest, address);
+                } else {
+                    store<quint32>(dest, static_cast<quint32>(address));
+                }
+            }
+            continue;
+        }
+
+        switch (field.type) {
+        case Char:
+            if (field.count == 1) {
+                *dest = static_cast<char>('a' + seed % 26);
+            } else if (textSamples) {
+                // Rows of a two-dimensional array are filled one by one
+                int open = field.name.lastIndexOf('[');
+                int width = field.name.mid(open + 1, field.name.size() - open - 2).toInt();
+                for (int row = 0; row < field.count / width; row++) {
+                    fillText(dest + row * width, width, seed * 3 + row);
+                }
+            } else {
+                QByteArray text = "Item." + QByteArray::number(seed);
+                memset(dest, 0, field.count);
+                memcpy(dest, text.constData(), qMin(text.size(), field.count - 1));
+            }
+            dest += field.count;
+            break;
+        case Short:
+            for (int i = 0; i < field.count; i++, dest += 2) {
+                store<quint16>(dest, static_cast<quint16>((seed * 31 + i) & 0x7fff));
+            }
+            break;
+        case Int:
+            for (int i = 0; i < field.count; i++, dest += 4) {
+                store<quint32>(dest, seed + i);
+            }
+            break;
+        case Float:
+            for (int i = 0; i < field.count; i++, dest += 4) {
+                float value = std::sin(seed * 0.37f + i) * 100.0f;
+                quint32 bits;
+                memcpy(&bits, &value, sizeof(bits));
+                store<quint32>(dest, bits);
+            }
+            break;
+        case Double:
+            for (int i = 0; i < field.count; i++, dest += 8) {
+                double value = seed / 7.0 + i;
+                quint64 bits;
+                memcpy(&bits, &value, sizeof(bits));
+                store<quint64>(dest, bits);
+            }
+            break;
+        case UInt64:
+            for (int i = 0; i < field.count; i++, dest += 8) {
+                store<quint64>(dest, seed * Q_UINT64_C(0x9e3779b97f4a7c15) + i);
+            }
+            break;
+        case Void:
+            break;
+        default:
+            for (int i = 0; i < field.count; i++) {
+                fill(dest, structureIndex(field.type), seed + i, addresses);
+                dest += typelengths[field.type];
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * One row of a char array, cycling through plain names and the cases that
+ * take the slower paths of the conversion.
+ */
+void BlendGenerator::fillText(char *dest, int width, uint32_t seed) const
+{
+    static const char *const samples[] = {
+        "Caf\xe9 cr\xe8me",              // Latin-1
+        "Ma\xc3\xb1" "ana \xe2\x82\xac", // UTF-8
+        "\xff\xfe\x80 broken \xc3",      // invalid UTF-8
+        "a < b && \"c\" > 'd'",          // markup
+        "tab\there\nnew\x01line\x7f",    // control characters
+    };
+    const int sampleCount = sizeof(samples) / sizeof(samples[0]);
+
+    memset(dest, 0, width);
+    QByteArray text = "Item." + QByteArray::number(seed);
+    switch (seed % 10) {
+    case 0:
+    case 1:
+    case 2:
+        break;
+    case 3:
+        // Text after the terminating NUL
+        text += '\0';
+        text += "hidden";
+        break;
+    case 4:
+        // No terminating NUL at all
+        text = text.repeated(width / text.size() + 1).left(width);
+        break;
+    case 5:
+        text = QByteArray();
+        break;
+    case 6: {
+        uint32_t state = seed;
+        text.resize(width);
+        for (int i = 0; i < width; i++) {
+            state = state * 1103515245u + 12345u;
+            text[i] = static_cast<char>(state >> 24);
+        }
+        break;
+    }
+    default:
+        text = samples[seed % sampleCount];
+        break;
+    }
+    memcpy(dest, text.constData(), qMin(text.size(), width));
+}
+
+QByteArray BlendGenerator::dna() const
+{
+    QByteArray data("SDNA");
+
+    data.append("NAME");
+    append<quint32>(data, names.length());
+    for (const QByteArray &name : names) {
+        data.append(name);
+        data.append('\0');
+    }
+    data.append(QByteArray((4 - data.size() % 4) % 4, '\0'));
+
+    data.append("TYPE");
+    append<quint32>(data, typenames.length());
+    for (const QByteArray &type : typenames) {
+        data.append(type);
+        data.append('\0');
+    }
+    data.append(QByteArray((4 - data.size() % 4) % 4, '\0'));
+
+    data.append("TLEN");
+    for (int length : typelengths) {
+        append<quint16>(data, static_cast<quint16>(length));
+    }
+    data.append(QByteArray((4 - data.size() % 4) % 4, '\0'));
+
+    data.append("STRC");
+    append<quint32>(data, structures.length());
+    for (const StructDef &structure : structures) {
+        append<quint16>(data, static_cast<quint16>(structure.type));
+        append<quint16>(data, static_cast<quint16>(structure.fields.length()));
+        for (const FieldDef &field : structure.fields) {
+            append<quint16>(data, static_cast<quint16>(field.type));
+            append<quint16>(data, static_cast<quint16>(names.indexOf(field.name)));
+        }
+    }
+    return data;
+}
+
+template<typename T>
+void BlendGenerator::store(char *dest, T value) const
+{
+    if (bigEndian) {
+        qToBigEndian<T>(value, dest);
+    } else {
+        qToLittleEndian<T>(value, dest);
+    }
+}
+
+template<typename T>
+void BlendGenerator::append(QByteArray &data, T value) const
+{
+    int pos = data.size();
+    data.resize(pos + static_cast<int>(sizeof(T)));
+    store<T>(data.data() + pos, value);
+}
+
+void BlendGenerator::appendAddress(QByteArray &data, uint64_t value) const
+{
+    if (pointerSize == 8) {
+        append<quint64>(data, value);
+    } else {
+        append<quint32>(data, static_cast<quint32>(value));
+    }
+}
+
+void BlendGenerator::appendBlockHeader(QByteArray &data, const char *code, uint32_t size, uint64_t address, uint32_t sdnaIndex, uint32_t count) const
+{
+    data.append(code, 4);
+    append<quint32>(data, size);
+    appendAddress(data, address);
+    append<quint32>(data, sdnaIndex);
+    append<quint32>(data, count);
+}
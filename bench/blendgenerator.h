@@ -0,0 +1,86 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLENDGENERATOR_H
+#define BLENDGENERATOR_H
+
+#include <inttypes.h>
+
+#include <QByteArray>
+#include <QList>
+
+/*
+ * Writes synthetic .blend files for the benchmark. The SDNA describes a
+ * chain of nested structures (Node<depth> contains Node<depth - 1> and so
+ * on down to Leaf), every block holds elements of one of them and the
+ * pointers in the data refer to other blocks, so the conversion exercises
+ * the same paths as a real file. With textSamples, char arrays hold the
+ * awkward cases as well: embedded NULs, bytes above ASCII, control and
+ * markup characters and rows without a terminating NUL.
+ */
+class BlendGenerator
+{
+public:
+    BlendGenerator(int pointerSize, bool bigEndian, int depth, int arraySize, bool textSamples = false);
+
+    QByteArray generate(int blocks, int elements) const;
+
+private:
+    enum PrimitiveType { Char, Short, Int, Float, Double, UInt64, Void, FirstStruct };
+
+    struct FieldDef
+    {
+        QByteArray typeName;
+        int type;
+        QByteArray name;
+        bool isPointer;
+        int count;
+    };
+
+    struct StructDef
+    {
+        int type;
+        QList<FieldDef> fields;
+    };
+
+    int pointerSize;
+    bool bigEndian;
+    bool textSamples;
+    QList<QByteArray> typenames;
+    QList<int> typelengths;
+    QList<QByteArray> names;
+    QList<StructDef> structures;
+
+    void addStructure(const QByteArray &type, QList<FieldDef> fields);
+    FieldDef field(const QByteArray &type, const QByteArray &name, int count = 1) const;
+    int structureIndex(int type) const;
+
+    void fill(char *dest, int structure, uint32_t seed, const QList<uint64_t> &addresses) const;
+    void fillText(char *dest, int width, uint32_t seed) const;
+    QByteArray dna() const;
+
+    template<typename T>
+    void store(char *dest, T value) const;
+    template<typename T>
+    void append(QByteArray &data, T value) const;
+    void appendAddress(QByteArray &data, uint64_t value) const;
+    void appendBlockHeader(QByteArray &data, const char *code, uint32_t size, uint64_t address, uint32_t sdnaIndex, uint32_t count) const;
+};
+
+#endif // BLENDGENERATOR_H
@@ -0,0 +1,337 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include <QFile>
+#include <QBuffer>
+#include <QThread>
+#include <QProcess>
+#include <QTextStream>
+#include <QTemporaryFile>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include "blendtoxml.h"
+#include "blendgenerator.h"
+#include "memoryusage.h"
+
+/*
+ * Discards the XML, so that the benchmark measures the conversion and not
+ * the disk it would be written to.
+ */
+class NullDevice : public QIODevice
+{
+public:
+    NullDevice() : written(0) {}
+
+    qint64 written;
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *, qint64 len)
+    {
+        written += len;
+        return len;
+    }
+};
+
+// The numbers a child process reports for one file, in this order
+enum Measurement { Scan, Dna, Types, Data, Total, PeakResident, HeapInUse, MeasurementCount };
+
+/*
+ * Converts the file repeat times and prints the phase times of the fastest
+ * run, the peak RSS of the process and the heap still in use when the
+ * conversion was done. Run in a child process per file, so that the peak
+ * RSS is that of one file and not the largest seen so far.
+ */
+static int convert(const QString &path, int jobs, int repeat, QTextStream &qout, QTextStream &qerr)
+{
+    qint64 best[MeasurementCount] = {};
+    best[Total] = -1;
+    for (int run = 0; run < repeat; run++) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            qerr << "open " << file.fileName() << ": " << file.errorString() << "\n";
+            return 1;
+        }
+        NullDevice out;
+        out.open(QIODevice::WriteOnly);
+
+        BlendToXml task(&file, &out, false, false, false);
+        task.setJobs(jobs);
+        task.run();
+        if (!task.errorString().isEmpty()) {
+            qerr << task.errorString() << "\n";
+            return 1;
+        }
+
+        const PhaseTimings &timings = task.timings();
+        qint64 total = timings.scan + timings.dna + timings.types + timings.data;
+        if (best[Total] < 0 || total < best[Total]) {
+            best[Scan] = timings.scan;
+            best[Dna] = timings.dna;
+            best[Types] = timings.types;
+            best[Data] = timings.data;
+            best[Total] = total;
+            best[HeapInUse] = memoryUsage().heapInUse;
+        }
+    }
+    best[PeakResident] = memoryUsage().peakResident;
+
+    for (int i = 0; i < MeasurementCount; i++) {
+        qout << best[i] << (i + 1 < MeasurementCount ? " " : "\n");
+    }
+    return 0;
+}
+
+// The XML of a file converted on the given number of threads
+static bool convertToXml(const QString &path, int jobs, QByteArray *xml, QString *error)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = QString("open %1: %2").arg(path, file.errorString());
+        return false;
+    }
+    xml->clear();
+    QBuffer out(xml);
+    out.open(QIODevice::WriteOnly);
+
+    BlendToXml task(&file, &out, false, false, false);
+    task.setJobs(jobs);
+    task.run();
+    *error = task.errorString();
+    return error->isEmpty();
+}
+
+// Where two outputs first differ, as a line number, or 0 if they are equal
+static int firstDifference(const QByteArray &a, const QByteArray &b)
+{
+    int length = qMin(a.size(), b.size());
+    int i = 0;
+    while (i < length && a[i] == b[i]) {
+        i++;
+    }
+    if (i == length && a.size() == b.size()) {
+        return 0;
+    }
+    return a.left(i).count('\n') + 1;
+}
+
+/*
+ * Converts generated files whose char arrays hold text samples on one
+ * thread and on jobs threads and, if given, with a reference build of
+ * blend2xml. All outputs must be identical.
+ */
+static int check(const QString &path, const QString &name, int jobs, const QString &reference, QTextStream &qout)
+{
+    QByteArray sequential, parallel;
+    QString error;
+    if (!convertToXml(path, 1, &sequential, &error) || !convertToXml(path, jobs, &parallel, &error)) {
+        qout << name << ": " << error << "\n";
+        return 1;
+    }
+
+    int failures = 0;
+    if (int line = firstDifference(sequential, parallel)) {
+        qout << name << ": -j " << jobs << " differs from -j 1 at line " << line << "\n";
+        failures++;
+    }
+
+    if (!reference.isEmpty()) {
+        QProcess process;
+        process.start(reference, QStringList() << path);
+        if (!process.waitForFinished(-1) || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+            qout << name << ": " << reference << " failed: " << QString::fromLocal8Bit(process.readAllStandardError()) << "\n";
+            return failures + 1;
+        }
+        if (int line = firstDifference(process.readAllStandardOutput(), sequential)) {
+            qout << name << ": differs from " << reference << " at line " << line << "\n";
+            failures++;
+        }
+    }
+
+    if (!failures) {
+        qout << name << ": " << sequential.size() << " bytes identical\n";
+    }
+    return failures;
+}
+
+static QStringList expand(const QString &value, const QString &both, const QStringList &all)
+{
+    return value == both ? all : QStringList(value);
+}
+
+static double megabytes(qint64 bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+static QString megabytesOrDash(qint64 bytes, int width)
+{
+    return bytes < 0 ? QString("-").rightJustified(width) : QString("%1").arg(megabytes(bytes), width, 'f', 1);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCoreApplication::setApplicationName("blend2xml-bench");
+    QCoreApplication::setApplicationVersion("1.0");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Converts synthetic .blend files and reports the time of each phase.");
+    parser.addHelpOption();
+
+    QCommandLineOption pointerSizeOption("pointer-size", QCoreApplication::translate("main", "Pointer size of the files: 4, 8 or both."), "size", "both");
+    parser.addOption(pointerSizeOption);
+
+    QCommandLineOption endianOption("endian", QCoreApplication::translate("main", "Byte order of the files: little, big or both."), "order", "both");
+    parser.addOption(endianOption);
+
+    QCommandLineOption blocksOption("blocks", QCoreApplication::translate("main", "Number of blocks per file."), "n", "2000");
+    parser.addOption(blocksOption);
+
+    QCommandLineOption elementsOption("elements", QCoreApplication::translate("main", "Number of elements per block."), "n", "16");
+    parser.addOption(elementsOption);
+
+    QCommandLineOption depthOption("depth", QCoreApplication::translate("main", "Nesting depth of the structures."), "n", "3");
+    parser.addOption(depthOption);
+
+    QCommandLineOption arrayOption("array", QCoreApplication::translate("main", "Length of the array fields."), "n", "32");
+    parser.addOption(arrayOption);
+
+    QCommandLineOption jobsOption(QStringList() << "j" << "jobs", QCoreApplication::translate("main", "Format blocks on <n> threads (0 = all cores)."), "n", "1");
+    parser.addOption(jobsOption);
+
+    QCommandLineOption repeatOption("repeat", QCoreApplication::translate("main", "Convert every file <n> times and report the fastest run."), "n", "3");
+    parser.addOption(repeatOption);
+
+    QCommandLineOption convertOption("convert", QCoreApplication::translate("main", "Convert <file> and print the raw measurements of the fastest run."), "file");
+    convertOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    parser.addOption(convertOption);
+
+    QCommandLineOption checkOption("check", QCoreApplication::translate("main", "Compare the XML of files with awkward char arrays written on one and on --jobs threads (at least 2) instead of timing."));
+    parser.addOption(checkOption);
+
+    QCommandLineOption referenceOption("reference", QCoreApplication::translate("main", "With --check, also compare with the output of the blend2xml <program>."), "program");
+    parser.addOption(referenceOption);
+
+    parser.process(*qApp);
+
+    QTextStream qout(stdout);
+    QTextStream qerr(stderr);
+
+    const QStringList pointerSizes = expand(parser.value(pointerSizeOption), "both", QStringList() << "4" << "8");
+    const QStringList endians = expand(parser.value(endianOption), "both", QStringList() << "little" << "big");
+
+    int values[5];
+    const QCommandLineOption *numberOptions[5] = { &blocksOption, &elementsOption, &depthOption, &arrayOption, &repeatOption };
+    for (int i = 0; i < 5; i++) {
+        bool valid;
+        values[i] = parser.value(*numberOptions[i]).toInt(&valid);
+        if (!valid || values[i] < 1) {
+            qerr << numberOptions[i]->names().first() << ": expected a positive number\n";
+            return 1;
+        }
+    }
+    int blocks = values[0], elements = values[1], depth = values[2], arraySize = values[3], repeat = values[4];
+
+    bool jobsValid;
+    int jobs = parser.value(jobsOption).toInt(&jobsValid);
+    if (!jobsValid || jobs < 0) {
+        qerr << "jobs: expected a non-negative number\n";
+        return 1;
+    }
+    if (jobs == 0) {
+        jobs = QThread::idealThreadCount();
+    }
+
+    if (parser.isSet(convertOption)) {
+        return convert(parser.value(convertOption), jobs, repeat, qout, qerr);
+    }
+
+    const bool checking = parser.isSet(checkOption);
+    int failures = 0;
+    if (!checking) {
+        qout << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10\n")
+                .arg("file", -12).arg("MB", 8).arg("scan ms", 9).arg("dna ms", 9).arg("types ms", 9)
+                .arg("data ms", 9).arg("total ms", 9).arg("MB/s", 9).arg("peak RSS MB", 12).arg("heap MB", 9);
+    }
+
+    for (const QString &pointerSize : pointerSizes) {
+        for (const QString &endian : endians) {
+            if ((pointerSize != "4" && pointerSize != "8") || (endian != "little" && endian != "big")) {
+                qerr << "unknown configuration: " << pointerSize << " " << endian << "\n";
+                return 1;
+            }
+
+            QString name = QString("%1-%2").arg(pointerSize == "4" ? "ptr4" : "ptr8", endian == "big" ? "be" : "le");
+            BlendGenerator generator(pointerSize.toInt(), endian == "big", depth, arraySize, checking);
+            QTemporaryFile source;
+            if (!source.open() || source.write(generator.generate(blocks, elements)) < 0 || !source.flush()) {
+                qerr << "temporary file: " << source.errorString() << "\n";
+                return 1;
+            }
+            qint64 size = source.size();
+
+            if (checking) {
+                failures += check(source.fileName(), name, qMax(jobs, 2), parser.value(referenceOption), qout);
+                qout.flush();
+                continue;
+            }
+
+            QProcess child;
+            child.start(QCoreApplication::applicationFilePath(), QStringList()
+                        << "--convert" << source.fileName() << "--jobs" << QString::number(jobs) << "--repeat" << QString::number(repeat));
+            if (!child.waitForFinished(-1)) {
+                qerr << name << ": " << child.errorString() << "\n";
+                return 1;
+            }
+            if (child.exitStatus() != QProcess::NormalExit || child.exitCode() != 0) {
+                qerr << name << ": " << QString::fromLocal8Bit(child.readAllStandardError());
+                return 1;
+            }
+
+            QList<QByteArray> fields = child.readAllStandardOutput().trimmed().split(' ');
+            qint64 best[MeasurementCount];
+            bool valid = fields.length() == MeasurementCount;
+            for (int i = 0; valid && i < MeasurementCount; i++) {
+                best[i] = fields.at(i).toLongLong(&valid);
+            }
+            if (!valid) {
+                qerr << name << ": unexpected output from --convert\n";
+                return 1;
+            }
+
+            qout << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10\n")
+                    .arg(name, -12)
+                    .arg(megabytes(size), 8, 'f', 1)
+                    .arg(best[Scan] / 1e6, 9, 'f', 2)
+                    .arg(best[Dna] / 1e6, 9, 'f', 2)
+                    .arg(best[Types] / 1e6, 9, 'f', 2)
+                    .arg(best[Data] / 1e6, 9, 'f', 2)
+                    .arg(best[Total] / 1e6, 9, 'f', 2)
+                    .arg(megabytes(size) / (best[Total] / 1e9), 9, 'f', 1)
+                    .arg(megabytesOrDash(best[PeakResident], 12))
+                    .arg(megabytesOrDash(best[HeapInUse], 9));
+            qout.flush();
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+QT       += core xml
+QT       -= gui
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/blendfile.cpp $$PWD/blendtoxml.cpp $$PWD/blendinput.cpp $$PWD/compressedinput.cpp $$PWD/compressedoutput.cpp $$PWD/xmlwriter.cpp $$PWD/packwriter.cpp $$PWD/blockindex.cpp $$PWD/addressindex.cpp $$PWD/arrayextractor.cpp $$PWD/readahead.cpp $$PWD/dnacache.cpp $$PWD/blenderror.cpp $$PWD/xxhash64.cpp $$PWD/memoryusage.cpp
+HEADERS += $$PWD/blendfile.h $$PWD/blendtoxml.h $$PWD/blendinput.h $$PWD/compressedinput.h $$PWD/compressedoutput.h $$PWD/xmlwriter.h $$PWD/packwriter.h $$PWD/blockindex.h $$PWD/addressindex.h $$PWD/arrayextractor.h $$PWD/readahead.h $$PWD/dnacache.h $$PWD/blenderror.h $$PWD/xxhash64.h $$PWD/memoryusage.h
+
+CONFIG += c++17
+
+win32: LIBS += -lpsapi
+
+CONFIG += link_pkgconfig
+
+packagesExist(zlib) {
+    PKGCONFIG += zlib
+    DEFINES += HAVE_ZLIB
+}
+
+packagesExist(libzstd) {
+    PKGCONFIG += libzstd
+    DEFINES += HAVE_ZSTD
+}
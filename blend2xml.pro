@@ -1,12 +1,10 @@
-QT       += core xml
-QT       -= gui
-
 TARGET = blend2xml
 CONFIG   += console
 CONFIG   -= app_bundle
 
 TEMPLATE = app
-SOURCES += main.cpp blendtoxml.cpp
-HEADERS +=  blendtoxml.h
+QT += network
+SOURCES += main.cpp blendserver.cpp
+HEADERS += blendserver.h
 
-CONFIG += c++11
+include(blend2xml.pri)
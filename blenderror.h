@@ -0,0 +1,48 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLENDERROR_H
+#define BLENDERROR_H
+
+#include <exception>
+
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Thrown when a file cannot be converted. BlendToXml::run() catches it
+ * and reports the message, so one broken file does not end a batch.
+ */
+class BlendError : public std::exception
+{
+public:
+    explicit BlendError(const QString &message) : m_message(message), m_what(message.toLocal8Bit()) {}
+
+    const QString &message() const { return m_message; }
+    const char *what() const noexcept { return m_what.constData(); }
+
+private:
+    QString m_message;
+    QByteArray m_what;
+};
+
+// Throws a BlendError with a printf style message
+[[noreturn]] void blendError(const char *format, ...) Q_ATTRIBUTE_FORMAT_PRINTF(1, 2);
+
+#endif // BLENDERROR_H
@@ -0,0 +1,731 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "blendfile.h"
+#include "blendinput.h"
+#include "blockindex.h"
+#include "dnacache.h"
+#include "blenderror.h"
+
+#include <algorithm>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+
+int StringTable::indexOf(const QString &text) const
+{
+    for (int i = 0; i < m_offsets.length(); i++) {
+        if (text == at(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int StringTable::append(const char *text, int len)
+{
+    m_offsets.append(m_data.size());
+    m_data.append(text, len);
+    m_data.append('\0');
+    return m_offsets.length() - 1;
+}
+
+void StringTable::clear()
+{
+    m_data.clear();
+    m_offsets.clear();
+}
+
+void StringTable::setData(const QByteArray &data)
+{
+    m_data = data;
+    m_offsets.clear();
+    for (int begin = 0; begin < m_data.size(); begin += qstrlen(m_data.constData() + begin) + 1) {
+        m_offsets.append(begin);
+    }
+}
+
+static bool isLetterOrNumber(char c)
+{
+    return QChar(QLatin1Char(c)).isLetterOrNumber();
+}
+
+static bool contains(QLatin1String text, const char *part)
+{
+    const char *end = text.data() + text.size();
+    return std::search(text.data(), end, part, part + strlen(part)) != end;
+}
+
+// Digits of an array dimension, 0 if they are not a number
+static size_t dimension(const char *begin, const char *end)
+{
+    size_t value = 0;
+    if (begin == end) {
+        return 0;
+    }
+    for (const char *p = begin; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        value = value * 10 + static_cast<size_t>(*p - '0');
+    }
+    return value;
+}
+
+CombType::CombType(QLatin1String name)
+    : isPointer(false), width(1), height(1)
+{
+    const char *text = name.data();
+    const int length = name.size();
+    bool isFunction = name.startsWith(QLatin1String("(*"));
+    int pos = isFunction ? 2 : 0;
+
+    while (pos < length && text[pos] == '*') {
+        pos++;
+    }
+    isPointer = pos > 0;
+    printType = isFunction ? QByteArray("(*)()") : QByteArray(text, pos);
+
+    int start = pos;
+    while (pos < length && (isLetterOrNumber(text[pos]) || text[pos] == '_')) {
+        pos++;
+    }
+    shortname = QLatin1String(text + start, pos - start);
+
+    int dimensions = 0;
+    const char *end = text + length;
+    const char *first = std::find(text + pos, end, '[');
+    const char *last = first;
+    while (last != end) {
+        const char *close = std::find(last, end, ']');
+        if (close == end) {
+            break;
+        }
+        size_t size = dimension(last + 1, close);
+        if (dimensions++ == 0) {
+            width = size;
+        } else {
+            height *= size;
+        }
+        pos = static_cast<int>(close + 1 - text);
+        last = std::find(close + 1, end, '[');
+    }
+
+    if (dimensions) {
+        printType.append(first, static_cast<int>(text + pos - first));
+    }
+}
+
+static bool isPadName(QLatin1String name)
+{
+    int pos = 0;
+    while (pos < name.size() && name.data()[pos] == '_') {
+        pos++;
+    }
+    if (name.size() - pos < 3 || memcmp(name.data() + pos, "pad", 3) != 0) {
+        return false;
+    }
+    for (pos += 3; pos < name.size(); pos++) {
+        if (name.data()[pos] < '0' || name.data()[pos] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isTextName(QLatin1String name)
+{
+    return contains(name, "name") ||
+           contains(name, "title") ||
+           contains(name, "filepath") ||
+           contains(name, "string") ||
+           name == QLatin1String("dir") ||
+           name == QLatin1String("file") ||
+           name.endsWith(QLatin1String("str"));
+}
+
+BlendFile::BlendFile(QIODevice *device)
+    : m_device(device), m_streaming(false), m_sharedCache(nullptr),
+      m_pointerSize(0), m_bigEndian(false), m_scanTime(0), m_dnaTime(0),
+      m_loaded(false), m_hasIdNames(false)
+{}
+
+BlendFile::~BlendFile()
+{}
+
+void BlendFile::setStreaming(bool streaming)
+{
+    m_streaming = streaming;
+}
+
+void BlendFile::setCachePath(const QString &directory)
+{
+    m_cachePath = directory;
+}
+
+void BlendFile::setSharedCache(SharedDnaCache *cache)
+{
+    m_sharedCache = cache;
+}
+
+void BlendFile::setIndexPath(const QString &path)
+{
+    m_indexPath = path;
+}
+
+void BlendFile::open()
+{
+    m_input.reset(BlendInput::create(m_device, m_streaming));
+
+    m_header = m_input->read(0, 12);
+    if (m_header.size() < 12) {
+        blendError("File is too short to be a .blend file");
+    }
+    if (!m_header.startsWith("BLENDER")) {
+        blendError("Not a .blend file");
+    }
+    m_pointerSize = (m_header[7] == '_') ? 4 : 8;
+    m_bigEndian = m_header[8] == 'V';
+}
+
+void BlendFile::load()
+{
+    if (m_loaded) {
+        return;
+    }
+    if (!m_input) {
+        open();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!loadIndex()) {
+        withDecoder(m_bigEndian, m_pointerSize, [&](auto decoder) { scanBlocks<decltype(decoder)>(); });
+    }
+    for (int i = 0; i < m_blocks.length(); i++) {
+        m_blocks[i].index = static_cast<uint32_t>(i);
+    }
+    m_scanTime = timer.nsecsElapsed();
+    timer.start();
+
+    QByteArray cacheKey = m_cachePath.isEmpty() && !m_sharedCache ? QByteArray() : DnaCache::keyFor(m_dna, m_pointerSize);
+    if (!loadDnaCache(cacheKey)) {
+        withDecoder(m_bigEndian, m_pointerSize, [&](auto decoder) { parseDna<decltype(decoder)>(); });
+        saveDnaCache(cacheKey);
+    }
+    buildFieldIndex();
+
+    for (const Block &block : m_blocks) {
+        if (block.sdnaIndex >= static_cast<uint32_t>(m_structures.length())) {
+            blendError("Block %s refers to unknown structure %u", qPrintable(QString(block.name())), block.sdnaIndex);
+        }
+    }
+    m_dnaTime = timer.nsecsElapsed();
+    m_loaded = true;
+}
+
+void BlendFile::close()
+{
+    m_input.reset();
+}
+
+bool BlendFile::isInMemory() const
+{
+    return m_input && m_input->isInMemory();
+}
+
+QString BlendFile::version() const
+{
+    return QString::fromLatin1(m_header.constData() + 9, 3);
+}
+
+uint32_t BlendFile::structureIndex(const QString &type) const
+{
+    int i = m_typeNames.indexOf(type);
+    return i < 0 ? NOTYPE : m_typeStructures.at(i);
+}
+
+int BlendFile::fieldIndex(uint32_t structure, const QByteArray &name) const
+{
+    return m_fieldIndex.at(structure).value(name, -1);
+}
+
+QByteArray BlendFile::read(qint64 pos, qint64 len) const
+{
+    return m_input->read(pos, len);
+}
+
+BlockView BlendFile::view(const Block &block) const
+{
+    return BlockView(this, block, blockData(block));
+}
+
+/*
+ * Reads all block headers up to DNA1 and the DNA1 block.
+ */
+template<typename D>
+void BlendFile::scanBlocks()
+{
+    const qint64 headerSize = 16 + D::PointerSize;
+    qint64 pos = 12;
+
+    for (;;) {
+        QByteArray header = m_input->read(pos, headerSize);
+        if (header.size() < headerSize) {
+            blendError("Unexpected end of file: no DNA1 block found");
+        }
+        auto h = reinterpret_cast<const uchar *>(header.constData());
+
+        Block b;
+        memcpy(b.code, h, sizeof(b.code));
+        b.size = D::template load<quint32>(h + 4);
+        b.oldMemoryAddress = D::loadAddress(h + 8);
+        b.sdnaIndex = D::template load<quint32>(h + 8 + D::PointerSize);
+        b.count = D::template load<quint32>(h + 12 + D::PointerSize);
+        b.pos = pos + headerSize;
+        b.index = 0;
+        b.idName = -1;
+        pos = b.pos + b.size;
+
+        if (b.hasCode("DNA1")) {
+            m_dna = m_input->read(b.pos, b.size);
+            return;
+        } else if (b.hasCode("ENDB")) {
+            blendError("Unexpected ENDB block: no DNA1 block found");
+        } else {
+            m_blocks.append(b);
+        }
+    }
+}
+
+bool BlendFile::loadDnaCache(const QByteArray &key)
+{
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    std::shared_ptr<const DnaCache> cache = m_sharedCache ? m_sharedCache->find(key) : nullptr;
+    if (!cache) {
+        auto loaded = std::make_shared<DnaCache>();
+        if (m_cachePath.isEmpty() || !loaded->load(DnaCache::pathFor(m_cachePath, key), key)) {
+            return false;
+        }
+        if (m_sharedCache) {
+            m_sharedCache->insert(key, loaded);
+        }
+        cache = loaded;
+    }
+
+    m_names = cache->names;
+    m_typeNames = cache->typenames;
+    m_typeLengths = cache->typelengths;
+    m_typeStructures = cache->typestructures;
+    m_structures = cache->structures;
+    m_layouts = cache->layouts;
+    checkLayouts();
+    return true;
+}
+
+// The cache is only an optimisation, a failure to write it is ignored
+void BlendFile::saveDnaCache(const QByteArray &key)
+{
+    if (key.isEmpty()) {
+        return;
+    }
+
+    auto cache = std::make_shared<DnaCache>();
+    cache->names = m_names;
+    cache->typenames = m_typeNames;
+    cache->typelengths = m_typeLengths;
+    cache->typestructures = m_typeStructures;
+    cache->structures = m_structures;
+    cache->layouts = m_layouts;
+    if (!m_cachePath.isEmpty()) {
+        cache->save(DnaCache::pathFor(m_cachePath, key), key);
+    }
+    if (m_sharedCache) {
+        m_sharedCache->insert(key, cache);
+    }
+}
+
+bool BlendFile::loadIndex()
+{
+    auto file = qobject_cast<QFile *>(m_device);
+    if (m_indexPath.isEmpty() || !file) {
+        return false;
+    }
+
+    BlockIndex index;
+    if (!index.load(m_indexPath, QFileInfo(file->fileName())) || index.header != m_input->read(0, 12)) {
+        return false;
+    }
+    m_blocks = index.blocks;
+    m_idNames = index.idNames;
+    m_dna = index.dna;
+    return true;
+}
+
+void BlendFile::saveIndex(const QString &path) const
+{
+    auto file = qobject_cast<QFile *>(m_device);
+    if (path.isEmpty() || !file) {
+        blendError("An index can only be written for a regular file");
+    }
+
+    BlockIndex index;
+    index.header = m_header;
+    index.blocks = m_blocks;
+    index.idNames = m_idNames;
+    index.dna = m_dna;
+    if (!index.save(path, QFileInfo(file->fileName()))) {
+        blendError("Cannot write index %s", qPrintable(path));
+    }
+}
+
+void BlendFile::readIdNames()
+{
+    // Copies share the block table until it is changed here
+    if (m_hasIdNames) {
+        return;
+    }
+    for (Block &block : m_blocks) {
+        const StructLayout &layout = m_layouts.at(block.sdnaIndex);
+        if (layout.idNameOffset < 0 || block.idName >= 0 || block.size < layout.size) {
+            continue;
+        }
+        QByteArray name = m_input->read(block.pos + layout.idNameOffset, layout.idNameLength);
+        block.idName = m_idNames.append(name.constData(), static_cast<int>(qstrnlen(name.constData(), name.size())));
+    }
+    m_hasIdNames = true;
+}
+
+uint32_t BlendFile::elementCount(const Block &block) const
+{
+    // Elements that do not fit into the block (raw DATA blocks) are not printed
+    uint32_t size = m_layouts.at(block.sdnaIndex).size;
+    if (size && block.count > block.size / size) {
+        return block.size / size;
+    }
+    return block.count;
+}
+
+template<typename D>
+void BlendFile::parseDna()
+{
+    const char *begin = m_dna.constData();
+    const char *end = begin + m_dna.size();
+    const char *p = begin;
+
+    auto require = [&](qint64 len) {
+        if (end - p < len) {
+            blendError("Unexpected end of DNA1 block");
+        }
+    };
+
+    auto readIdent = [&](const char *ident) {
+        // Identifiers are aligned to 4 bytes from the start of the block
+        p = begin + ((p - begin + 3) & ~3);
+        require(4);
+        if (memcmp(p, ident, 4) != 0) {
+            blendError("Malformed DNA1 block: %s expected", ident);
+        }
+        p += 4;
+    };
+
+    auto readUInt32 = [&]() {
+        require(4);
+        auto value = D::template load<quint32>(reinterpret_cast<const uchar *>(p));
+        p += 4;
+        return value;
+    };
+
+    auto readUInt16 = [&]() {
+        require(2);
+        auto value = D::template load<quint16>(reinterpret_cast<const uchar *>(p));
+        p += 2;
+        return value;
+    };
+
+    auto readString = [&](StringTable &table) {
+        uint len = qstrnlen(p, static_cast<uint>(end - p));
+        require(len + 1);
+        table.append(p, static_cast<int>(len));
+        p += len + 1;
+    };
+
+    readIdent("SDNA");
+
+    readIdent("NAME");
+    auto namesCount = readUInt32();
+    for (size_t i = 0; i < namesCount; i++) {
+        readString(m_names);
+    }
+
+    readIdent("TYPE");
+    auto types = readUInt32();
+    for (size_t i = 0; i < types; i++) {
+        readString(m_typeNames);
+    }
+
+    readIdent("TLEN");
+    for (size_t i = 0; i < types; i++) {
+        m_typeLengths << readUInt16();
+    }
+
+    for (size_t i = 0; i < types; i++) {
+        m_typeStructures.append(NOTYPE);
+    }
+
+    readIdent("STRC");
+    auto structuresCount = readUInt32();
+    for (uint32_t i = 0; i < structuresCount; i++) {
+        Structure s;
+        s.type = readUInt16();
+        if (s.type >= types || m_typeStructures[s.type] != NOTYPE) {
+            blendError("Malformed DNA1 block: invalid structure type %u", s.type);
+        }
+        m_typeStructures[s.type] = i;
+        auto fields = readUInt16();
+        for (size_t j = 0; j < fields; j++) {
+            Field f;
+            f.type = readUInt16();
+            f.name = readUInt16();
+            if (f.type >= types || f.name >= namesCount) {
+                blendError("Malformed DNA1 block: invalid field in structure %s", m_typeNames[s.type].data());
+            }
+            s.fields.append(f);
+        }
+        m_structures.append(s);
+    }
+
+    buildLayouts();
+}
+
+void BlendFile::buildLayouts()
+{
+    QVector<CombType> nameTypes;
+    nameTypes.reserve(m_names.length());
+    for (int i = 0; i < m_names.length(); i++) {
+        nameTypes.append(CombType(m_names.at(i)));
+    }
+
+    m_layouts.clear();
+    m_layouts.reserve(m_structures.length());
+    for (const Structure &structure : m_structures) {
+        StructLayout layout;
+        layout.tag = QString(m_typeNames.at(structure.type)).toUtf8();
+        layout.size = 0;
+
+        for (const Field &field : structure.fields) {
+            const CombType &ct = nameTypes[field.name];
+            bool isSingle = ct.width == 1 && ct.height == 1;
+
+            FieldLayout f;
+            f.type = field.type;
+            f.structure = m_typeStructures[field.type];
+            f.offset = layout.size;
+            f.width = static_cast<uint32_t>(ct.width);
+            f.height = static_cast<uint32_t>(ct.height);
+            f.isPad = isPadName(ct.shortname);
+            f.isFlag = isSingle && (contains(ct.shortname, "flag") || contains(ct.shortname, "type"));
+            f.isText = isTextName(ct.shortname);
+            f.tag = QString(ct.shortname).toUtf8();
+            f.printType = QString(m_typeNames[field.type]).toUtf8() + ct.printType;
+
+            uint32_t elementSize = m_typeLengths[field.type];
+            if (ct.isPointer) {
+                f.kind = FieldLayout::Pointer;
+                elementSize = m_pointerSize;
+            } else if (f.structure != NOTYPE) {
+                f.kind = FieldLayout::Struct;
+            } else if (m_typeNames[field.type] == QLatin1String("char")) {
+                f.kind = FieldLayout::Char;
+            } else {
+                switch (elementSize) {
+                case 0: f.kind = FieldLayout::Empty; break;
+                case 1: f.kind = FieldLayout::Int8; break;
+                case 2: f.kind = FieldLayout::Int16; break;
+                case 4: f.kind = m_typeNames[field.type] == QLatin1String("float") ? FieldLayout::Float : FieldLayout::Int32; break;
+                case 8: f.kind = m_typeNames[field.type] == QLatin1String("double") ? FieldLayout::Double : FieldLayout::Int64; break;
+                default:
+                    blendError("Unsupported length %u of type %s", elementSize, m_typeNames[field.type].data());
+                }
+            }
+
+            f.size = elementSize * f.width * f.height;
+            layout.size += f.size;
+            layout.fields.append(f);
+        }
+
+        layout.idNameOffset = -1;
+        layout.idNameLength = 0;
+        m_layouts.append(layout);
+    }
+
+    // Datablocks start with an ID whose name identifies them, e.g. "OBCube"
+    for (StructLayout &layout : m_layouts) {
+        if (layout.fields.isEmpty()) {
+            continue;
+        }
+        const FieldLayout &id = layout.fields.first();
+        if (id.kind != FieldLayout::Struct || m_typeNames[id.type] != QLatin1String("ID")) {
+            continue;
+        }
+        for (const FieldLayout &field : m_layouts.at(id.structure).fields) {
+            if (field.kind == FieldLayout::Char && field.tag == "name") {
+                layout.idNameOffset = static_cast<int32_t>(id.offset + field.offset);
+                layout.idNameLength = field.size;
+            }
+        }
+    }
+
+    checkLayouts();
+}
+
+/*
+ * Nested structures are stepped through by the size of their layout, so
+ * it has to match the length DNA1 gives their type, and no structure may
+ * contain itself by value.
+ */
+void BlendFile::checkLayouts() const
+{
+    const int count = m_layouts.length();
+    for (int i = 0; i < count; i++) {
+        uint32_t length = m_typeLengths[m_structures[i].type];
+        if (length != m_layouts[i].size) {
+            blendError("Malformed DNA1 block: structure %s is %u bytes long but its fields take %u",
+                       m_layouts[i].tag.data(), length, m_layouts[i].size);
+        }
+    }
+
+    // Depth first walk over by-value fields; a structure met again while
+    // it is still on the stack closes a cycle
+    enum { Unvisited, OnStack, Done };
+    QVector<int> state(count, Unvisited);
+    QVector<QPair<int, int>> stack;
+    for (int root = 0; root < count; root++) {
+        if (state[root] != Unvisited) {
+            continue;
+        }
+        state[root] = OnStack;
+        stack.append(qMakePair(root, 0));
+        while (!stack.isEmpty()) {
+            QPair<int, int> &top = stack.last();
+            const QList<FieldLayout> &fields = m_layouts[top.first].fields;
+            if (top.second == fields.length()) {
+                state[top.first] = Done;
+                stack.removeLast();
+                continue;
+            }
+            const FieldLayout &field = fields[top.second++];
+            if (field.kind != FieldLayout::Struct) {
+                continue;
+            }
+            int nested = static_cast<int>(field.structure);
+            if (state[nested] == OnStack) {
+                blendError("Malformed DNA1 block: structure %s contains itself", m_layouts[nested].tag.data());
+            }
+            if (state[nested] == Unvisited) {
+                state[nested] = OnStack;
+                stack.append(qMakePair(nested, 0));
+            }
+        }
+    }
+}
+
+void BlendFile::buildFieldIndex()
+{
+    m_fieldIndex.clear();
+    for (const StructLayout &layout : m_layouts) {
+        QHash<QByteArray, int> fields;
+        for (int i = 0; i < layout.fields.length(); i++) {
+            if (!layout.fields[i].isPad) {
+                fields.insert(layout.fields[i].tag, i);
+            }
+        }
+        m_fieldIndex.append(fields);
+    }
+}
+
+const FieldLayout *StructView::field(const QByteArray &name) const
+{
+    if (!m_data) {
+        return nullptr;
+    }
+    int i = m_file->fieldIndex(m_structure, name);
+    return i < 0 ? nullptr : &m_file->layouts().at(m_structure).fields.at(i);
+}
+
+const uchar *StructView::element(const FieldLayout *field, uint32_t index, FieldLayout::Kind kind) const
+{
+    if (!field || field->kind != kind || index >= field->width * field->height) {
+        return nullptr;
+    }
+    return m_data + field->offset + index * (field->size / (field->width * field->height));
+}
+
+uint64_t StructView::pointer(const QByteArray &name, uint32_t index) const
+{
+    const uchar *p = element(field(name), index, FieldLayout::Pointer);
+    return p ? m_file->decodeAddress(p) : 0;
+}
+
+QByteArray StructView::string(const QByteArray &name) const
+{
+    const FieldLayout *f = field(name);
+    const uchar *p = element(f, 0, FieldLayout::Char);
+    if (!p) {
+        return QByteArray();
+    }
+    auto text = reinterpret_cast<const char *>(p);
+    return QByteArray(text, static_cast<int>(qstrnlen(text, f->size)));
+}
+
+StructView StructView::structure(const QByteArray &name, uint32_t index) const
+{
+    const FieldLayout *f = field(name);
+    const uchar *p = element(f, index, FieldLayout::Struct);
+    if (!p) {
+        return StructView();
+    }
+    return StructView(m_file, f->structure, p, m_owner);
+}
+
+// A short read yields fewer elements than the block header promises
+uint32_t BlockView::count() const
+{
+    const uint32_t count = m_file->elementCount(m_block);
+    const uint32_t size = m_file->layouts().at(m_block.sdnaIndex).size;
+    if (size && count > static_cast<uint32_t>(m_data.size()) / size) {
+        return static_cast<uint32_t>(m_data.size()) / size;
+    }
+    return count;
+}
+
+StructView BlockView::element(uint32_t index) const
+{
+    if (index >= count()) {
+        return StructView();
+    }
+    const uint32_t size = m_file->layouts().at(m_block.sdnaIndex).size;
+    auto data = reinterpret_cast<const uchar *>(m_data.constData());
+    return StructView(m_file, m_block.sdnaIndex, data + index * size, m_data);
+}
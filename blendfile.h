@@ -0,0 +1,380 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLENDFILE_H
+#define BLENDFILE_H
+
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <inttypes.h>
+
+#include <QByteArray>
+#include <QHash>
+#include <QLatin1String>
+#include <QList>
+#include <QString>
+#include <QVector>
+#include <QtEndian>
+
+class QIODevice;
+class BlendInput;
+class SharedDnaCache;
+class BlockView;
+class StructView;
+
+/*
+ * Block header as plain data, so that the block table of a file with
+ * hundreds of thousands of blocks is a single array without an
+ * allocation per block.
+ */
+struct Block
+{
+    char code[4];       // NUL padded, e.g. "OB\0\0"
+    uint32_t size;
+    uint64_t oldMemoryAddress;
+    uint32_t sdnaIndex;
+    uint32_t count;
+    qint64 pos;
+    uint32_t index;     // position in the file
+    int32_t idName;     // BlendFile::idNames() entry of the ID name of the first element, -1 if none
+
+    QLatin1String name() const { return QLatin1String(code, static_cast<int>(qstrnlen(code, sizeof(code)))); }
+    bool hasCode(const char *other) const { return strncmp(code, other, sizeof(code)) == 0; }
+};
+Q_DECLARE_TYPEINFO(Block, Q_PRIMITIVE_TYPE);
+
+/*
+ * Strings stored back to back in one buffer, each followed by a NUL. The
+ * SDNA names and the ID names are kept this way instead of as thousands
+ * of separately allocated QStrings. at() returns a view into the buffer,
+ * which is valid until the table is changed.
+ */
+class StringTable
+{
+public:
+    int length() const { return m_offsets.length(); }
+    bool isEmpty() const { return m_offsets.isEmpty(); }
+
+    QLatin1String at(int i) const
+    {
+        const int begin = m_offsets.at(i);
+        const int end = i + 1 < m_offsets.length() ? m_offsets.at(i + 1) : m_data.size();
+        return QLatin1String(m_data.constData() + begin, end - begin - 1);
+    }
+    QLatin1String operator[](int i) const { return at(i); }
+
+    // Index of the first string equal to text, or -1
+    int indexOf(const QString &text) const;
+
+    // Copies len bytes of text and returns the index of the new string
+    int append(const char *text, int len);
+    void clear();
+
+    // All strings with their terminating NULs, as they are serialised
+    const QByteArray &data() const { return m_data; }
+    void setData(const QByteArray &data);
+
+private:
+    QByteArray m_data;
+    QVector<int> m_offsets;
+};
+
+struct Field
+{
+    uint16_t type;
+    uint16_t name;
+};
+
+struct Structure
+{
+    uint16_t type;
+    QList<Field> fields;
+};
+
+struct CombType
+{
+    bool isPointer;
+    size_t width, height;
+    QLatin1String shortname;    // points into the name
+    QByteArray printType;
+
+    CombType() : isPointer(false), width(1), height(1) {}
+    CombType(QLatin1String name);
+};
+
+struct FieldLayout
+{
+    enum Kind { Empty, Char, Int8, Int16, Int32, Int64, Float, Double, Pointer, Struct };
+
+    Kind kind;
+    uint16_t type;
+    uint32_t structure;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t width, height;
+    bool isPad;
+    bool isFlag;
+    bool isText;
+    QByteArray tag;         // UTF-8
+    QByteArray printType;   // UTF-8
+};
+
+struct StructLayout
+{
+    QByteArray tag;         // type name, UTF-8
+    uint32_t size;
+    QList<FieldLayout> fields;
+    int32_t idNameOffset;   // -1 if the structure does not start with an ID
+    uint32_t idNameLength;
+};
+
+/*
+ * A .blend file opened for reading: the file header, the block table and
+ * the parsed SDNA with the layout of every structure. Block contents are
+ * only read when they are asked for, and BlockView and StructView decode
+ * single fields from them on access. Errors are thrown as BlendError.
+ *
+ *     BlendFile file(&device);
+ *     file.load();
+ *     for (const Block &block : file.blocks()) {
+ *         if (file.typeName(block) == QLatin1String("Object")) {
+ *             StructView object = file.view(block).element(0);
+ *             qDebug() << object.structure("id").string("name") << object.value<float>("loc", 2);
+ *         }
+ *     }
+ *
+ * Copies are cheap: they share the input and the loaded tables, so a file
+ * that was loaded once can be handed to several readers.
+ */
+class BlendFile
+{
+public:
+    static constexpr uint32_t NOTYPE = 0xFFFFFFFF;
+
+    explicit BlendFile(QIODevice *device);
+    BlendFile(const BlendFile &other) = default;
+    BlendFile &operator=(const BlendFile &other) = default;
+    ~BlendFile();
+
+    void setStreaming(bool streaming);
+    void setCachePath(const QString &directory);
+    void setSharedCache(SharedDnaCache *cache);
+
+    // Block table to use instead of scanning the file, if it is up to date
+    void setIndexPath(const QString &path);
+
+    // Reads the file header; load() calls it when needed
+    void open();
+    // Reads the block table and the SDNA, unless they were loaded before
+    void load();
+    // Releases the input; the block table and the SDNA stay available
+    void close();
+
+    bool isOpen() const { return m_input != nullptr; }
+    // Block data is memory mapped or was read completely
+    bool isInMemory() const;
+    QByteArray header() const { return m_header; }
+    int pointerSize() const { return m_pointerSize; }
+    bool isBigEndian() const { return m_bigEndian; }
+    QString version() const;
+
+    const QVector<Block> &blocks() const { return m_blocks; }
+    const StringTable &names() const { return m_names; }
+    const StringTable &typeNames() const { return m_typeNames; }
+    const StringTable &idNames() const { return m_idNames; }
+    const QList<uint16_t> &typeLengths() const { return m_typeLengths; }
+    const QList<uint32_t> &typeStructures() const { return m_typeStructures; }
+    const QList<Structure> &structures() const { return m_structures; }
+    const QList<StructLayout> &layouts() const { return m_layouts; }
+
+    // Structure index of a type name, or NOTYPE
+    uint32_t structureIndex(const QString &type) const;
+    QLatin1String typeName(uint32_t structure) const { return m_typeNames.at(m_structures.at(structure).type); }
+    QLatin1String typeName(const Block &block) const { return typeName(block.sdnaIndex); }
+    // ID name of a block, empty if it has none or readIdNames() was not called
+    QLatin1String idName(const Block &block) const { return block.idName < 0 ? QLatin1String() : m_idNames.at(block.idName); }
+    // Field index within a structure, or -1
+    int fieldIndex(uint32_t structure, const QByteArray &name) const;
+
+    // Elements of a block that fit into it; raw DATA blocks may hold fewer
+    uint32_t elementCount(const Block &block) const;
+
+    // Bytes of the file, which may reference memory owned by the file
+    QByteArray read(qint64 pos, qint64 len) const;
+    QByteArray blockData(const Block &block) const { return read(block.pos, block.size); }
+    BlockView view(const Block &block) const;
+
+    // Reads the ID names of the blocks that start with an ID, once
+    void readIdNames();
+    void saveIndex(const QString &path) const;
+
+    // Time taken by load(), in nanoseconds
+    qint64 scanTime() const { return m_scanTime; }
+    qint64 dnaTime() const { return m_dnaTime; }
+
+    // Scalars in the byte order of the file
+    template<typename T>
+    T decode(const uchar *src) const
+    {
+        return m_bigEndian ? qFromBigEndian<T>(src) : qFromLittleEndian<T>(src);
+    }
+
+    uint64_t decodeAddress(const uchar *src) const
+    {
+        return m_pointerSize == 4 ? decode<quint32>(src) : decode<quint64>(src);
+    }
+
+private:
+    QIODevice *m_device;
+    std::shared_ptr<BlendInput> m_input;
+    bool m_streaming;
+    QString m_indexPath;
+    QString m_cachePath;
+    SharedDnaCache *m_sharedCache;
+
+    QByteArray m_header;
+    int m_pointerSize;
+    bool m_bigEndian;
+    QByteArray m_dna;
+    qint64 m_scanTime;
+    qint64 m_dnaTime;
+    bool m_loaded;
+    bool m_hasIdNames;
+
+    QVector<Block> m_blocks;
+    StringTable m_idNames;
+    StringTable m_names;
+    StringTable m_typeNames;
+    QList<uint16_t> m_typeLengths;
+    QList<uint32_t> m_typeStructures;
+    QList<Structure> m_structures;
+    QList<StructLayout> m_layouts;
+    QList<QHash<QByteArray, int>> m_fieldIndex;
+
+    template<typename D>
+    void scanBlocks();
+
+    template<typename D>
+    void parseDna();
+
+    bool loadIndex();
+    bool loadDnaCache(const QByteArray &key);
+    void saveDnaCache(const QByteArray &key);
+    void buildLayouts();
+    void checkLayouts() const;
+    void buildFieldIndex();
+};
+
+/*
+ * View of one structure in memory. Fields are looked up by name and
+ * decoded with the byte order of the file when they are read. Accessors
+ * return 0, an empty string or an invalid view for a field that does not
+ * exist or has a different kind; index selects an element of an array
+ * field.
+ */
+class StructView
+{
+public:
+    StructView() : m_file(nullptr), m_structure(BlendFile::NOTYPE), m_data(nullptr) {}
+    StructView(const BlendFile *file, uint32_t structure, const uchar *data, const QByteArray &owner = QByteArray())
+        : m_file(file), m_structure(structure), m_data(data), m_owner(owner) {}
+
+    bool isValid() const { return m_data != nullptr; }
+    uint32_t structureIndex() const { return m_structure; }
+    QLatin1String typeName() const { return m_file->typeName(m_structure); }
+    const uchar *data() const { return m_data; }
+
+    const FieldLayout *field(const QByteArray &name) const;
+    bool hasField(const QByteArray &name) const { return field(name) != nullptr; }
+
+    // Numbers converted to T, with the sign of T for integer fields
+    template<typename T>
+    T value(const QByteArray &name, uint32_t index = 0) const;
+    uint64_t pointer(const QByteArray &name, uint32_t index = 0) const;
+    // Text of a char array up to its first NUL
+    QByteArray string(const QByteArray &name) const;
+    StructView structure(const QByteArray &name, uint32_t index = 0) const;
+
+private:
+    const BlendFile *m_file;
+    uint32_t m_structure;
+    const uchar *m_data;
+    QByteArray m_owner;     // keeps copied block data alive
+
+    const uchar *element(const FieldLayout *field, uint32_t index, FieldLayout::Kind kind) const;
+};
+
+// The elements of a block
+class BlockView
+{
+public:
+    BlockView(const BlendFile *file, const Block &block, const QByteArray &data)
+        : m_file(file), m_block(block), m_data(data) {}
+
+    const Block &block() const { return m_block; }
+    QByteArray data() const { return m_data; }
+    uint32_t count() const;
+    StructView element(uint32_t index) const;
+
+private:
+    const BlendFile *m_file;
+    Block m_block;
+    QByteArray m_data;
+};
+
+template<typename T>
+T StructView::value(const QByteArray &name, uint32_t index) const
+{
+    const FieldLayout *f = field(name);
+    if (!f || index >= f->width * f->height) {
+        return T();
+    }
+    const uint32_t width = f->size / (f->width * f->height);
+    const uchar *p = m_data + f->offset + index * width;
+    const bool isSigned = std::is_signed<T>::value;
+
+    switch (f->kind) {
+    case FieldLayout::Char:
+    case FieldLayout::Int8:
+        return isSigned ? static_cast<T>(static_cast<qint8>(*p)) : static_cast<T>(*p);
+    case FieldLayout::Int16:
+        return isSigned ? static_cast<T>(m_file->decode<qint16>(p)) : static_cast<T>(m_file->decode<quint16>(p));
+    case FieldLayout::Int32:
+        return isSigned ? static_cast<T>(m_file->decode<qint32>(p)) : static_cast<T>(m_file->decode<quint32>(p));
+    case FieldLayout::Int64:
+        return isSigned ? static_cast<T>(m_file->decode<qint64>(p)) : static_cast<T>(m_file->decode<quint64>(p));
+    case FieldLayout::Float: {
+        quint32 bits = m_file->decode<quint32>(p);
+        float result;
+        memcpy(&result, &bits, sizeof(result));
+        return static_cast<T>(result);
+    }
+    case FieldLayout::Double: {
+        quint64 bits = m_file->decode<quint64>(p);
+        double result;
+        memcpy(&result, &bits, sizeof(result));
+        return static_cast<T>(result);
+    }
+    default:
+        return T();
+    }
+}
+
+#endif // BLENDFILE_H
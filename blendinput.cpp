@@ -0,0 +1,159 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "blendinput.h"
+#include "compressedinput.h"
+#include "blenderror.h"
+
+#include <algorithm>
+#include <climits>
+#include <QFileDevice>
+
+BlendInput *BlendInput::create(QIODevice *device, bool stream)
+{
+    auto format = CompressedInput::detect(device->peek(4));
+    if (format != CompressedInput::Unknown) {
+        std::unique_ptr<CompressedInput> input(CompressedInput::create(device, format));
+        if (!stream && !device->isSequential()) {
+            return input.release();
+        }
+        // A pipe cannot be rewound to a seek point, decode it forward once
+        return new StreamInput(device, input.release());
+    }
+
+    if (stream || device->isSequential()) {
+        return new StreamInput(device);
+    }
+
+    QFileDevice *file = qobject_cast<QFileDevice *>(device);
+    if (file && !file->isSequential() && file->size() > 0) {
+        uchar *data = file->map(0, file->size());
+        if (data) {
+            return new MappedInput(file, data, file->size());
+        }
+    }
+    return new BufferedInput(device->readAll());
+}
+
+MappedInput::MappedInput(QFileDevice *file, uchar *data, qint64 size)
+    : m_file(file), m_data(data), m_size(size)
+{}
+
+MappedInput::~MappedInput()
+{
+    m_file->unmap(m_data);
+}
+
+// A QByteArray holds at most INT_MAX bytes
+static void checkLength(qint64 len)
+{
+    if (len > INT_MAX) {
+        blendError("Cannot read %lld bytes at once", static_cast<long long>(len));
+    }
+}
+
+QByteArray MappedInput::read(qint64 pos, qint64 len)
+{
+    if (pos < 0 || pos >= m_size) {
+        return QByteArray();
+    }
+    len = qMin(len, m_size - pos);
+    checkLength(len);
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(m_data + pos), static_cast<int>(len));
+}
+
+QByteArray BufferedInput::read(qint64 pos, qint64 len)
+{
+    if (pos < 0 || pos >= m_data.size()) {
+        return QByteArray();
+    }
+    len = qMin(len, m_data.size() - pos);
+    checkLength(len);
+    return QByteArray::fromRawData(m_data.constData() + pos, static_cast<int>(len));
+}
+
+StreamInput::StreamInput(QIODevice *device, CompressedInput *decoder)
+    : m_device(device), m_decoder(decoder), m_memorySize(0), m_spooled(0), m_atEnd(false)
+{}
+
+StreamInput::~StreamInput()
+{}
+
+QByteArray StreamInput::read(qint64 pos, qint64 len)
+{
+    if (pos < 0) {
+        return QByteArray();
+    }
+    fill(pos + len);
+    len = qMin(len, m_spooled - pos);
+    if (len <= 0) {
+        return QByteArray();
+    }
+    checkLength(len);
+
+    QByteArray result;
+    if (pos < m_memorySize) {
+        int i = static_cast<int>(std::upper_bound(m_chunkPos.constBegin(), m_chunkPos.constEnd(), pos) - m_chunkPos.constBegin()) - 1;
+        qint64 offset = pos - m_chunkPos[i];
+        if (offset + len <= m_chunks[i].size()) {
+            return QByteArray::fromRawData(m_chunks[i].constData() + offset, static_cast<int>(len));
+        }
+        // The range spans several reads, copy it together
+        while (len > 0 && i < m_chunks.length()) {
+            qint64 n = qMin(len, m_chunks[i].size() - offset);
+            result.append(m_chunks[i].constData() + offset, static_cast<int>(n));
+            pos += n;
+            len -= n;
+            offset = 0;
+            i++;
+        }
+    }
+    if (len > 0) {
+        if (!m_spool.seek(pos - m_memorySize)) {
+            blendError("Cannot read spool file: %s", qPrintable(m_spool.errorString()));
+        }
+        result.append(m_spool.read(len));
+    }
+    return result;
+}
+
+void StreamInput::fill(qint64 end)
+{
+    while (m_spooled < end && !m_atEnd) {
+        QByteArray data = m_decoder ? m_decoder->read(m_spooled, end - m_spooled) : m_device->read(end - m_spooled);
+        if (data.isEmpty()) {
+            m_atEnd = true;
+            break;
+        }
+
+        if (!m_spool.isOpen() && m_memorySize + data.size() <= MemoryLimit) {
+            m_chunkPos.append(m_spooled);
+            m_chunks.append(data);
+            m_memorySize += data.size();
+        } else {
+            if (!m_spool.isOpen() && !m_spool.open()) {
+                blendError("Cannot create spool file: %s", qPrintable(m_spool.errorString()));
+            }
+            if (!m_spool.seek(m_spooled - m_memorySize) || m_spool.write(data) != data.size()) {
+                blendError("Cannot write spool file: %s", qPrintable(m_spool.errorString()));
+            }
+        }
+        m_spooled += data.size();
+    }
+}
@@ -0,0 +1,190 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLENDINPUT_H
+#define BLENDINPUT_H
+
+#include <cstring>
+#include <memory>
+#include <inttypes.h>
+
+#include <QtEndian>
+#include <QByteArray>
+#include <QList>
+#include <QTemporaryFile>
+
+class QIODevice;
+class QFileDevice;
+class CompressedInput;
+
+/*
+ * Random access to the bytes of a .blend file. Regular files are memory
+ * mapped and read() hands out views into the mapping without copying;
+ * compressed files are decoded on the fly by CompressedInput; pipes and
+ * streaming mode go through StreamInput.
+ */
+class BlendInput
+{
+public:
+    virtual ~BlendInput() {}
+
+    static BlendInput *create(QIODevice *device, bool stream = false);
+
+    // Size of the uncompressed file, or -1 when it is not known up front
+    virtual qint64 size() const = 0;
+
+    // Returns up to len bytes starting at pos. The result may reference
+    // memory owned by the input and must not outlive it.
+    virtual QByteArray read(qint64 pos, qint64 len) = 0;
+
+    // True if read() hands out views into memory without waiting for I/O
+    virtual bool isInMemory() const { return false; }
+};
+
+class MappedInput : public BlendInput
+{
+public:
+    MappedInput(QFileDevice *file, uchar *data, qint64 size);
+    ~MappedInput();
+
+    qint64 size() const { return m_size; }
+    QByteArray read(qint64 pos, qint64 len);
+    bool isInMemory() const { return true; }
+
+private:
+    QFileDevice *m_file;
+    uchar *m_data;
+    qint64 m_size;
+};
+
+class BufferedInput : public BlendInput
+{
+public:
+    explicit BufferedInput(const QByteArray &data) : m_data(data) {}
+
+    qint64 size() const { return m_data.size(); }
+    QByteArray read(qint64 pos, qint64 len);
+    bool isInMemory() const { return true; }
+
+private:
+    QByteArray m_data;
+};
+
+/*
+ * Reads the source forward exactly once, so it works on pipes and stdin.
+ * Blender writes DNA1 near the end of the file, so every byte read is
+ * spooled until the caller comes back for the block bodies: the first
+ * MemoryLimit bytes are kept in memory, the rest goes to a temporary file.
+ */
+class StreamInput : public BlendInput
+{
+public:
+    explicit StreamInput(QIODevice *device, CompressedInput *decoder = nullptr);
+    ~StreamInput();
+
+    qint64 size() const { return -1; }
+    QByteArray read(qint64 pos, qint64 len);
+
+private:
+    static const qint64 MemoryLimit = 64 << 20;
+
+    QIODevice *m_device;
+    std::unique_ptr<CompressedInput> m_decoder;
+    QList<qint64> m_chunkPos;
+    QList<QByteArray> m_chunks;
+    qint64 m_memorySize;
+    QTemporaryFile m_spool;
+    qint64 m_spooled;
+    bool m_atEnd;
+
+    void fill(qint64 end);
+};
+
+/*
+ * Loads of file scalars, specialised at compile time on the byte order
+ * and pointer size given in the file header.
+ */
+template<bool BigEndian, int PtrSize>
+struct Decoder
+{
+    enum { PointerSize = PtrSize };
+
+    template<typename T>
+    static inline T load(const uchar *src)
+    {
+        return BigEndian ? qFromBigEndian<T>(src) : qFromLittleEndian<T>(src);
+    }
+
+    // Converts count values at once; when the byte order differs from the
+    // host, QtCore swaps the whole array with SIMD instructions
+    template<typename T>
+    static inline void loadArray(const uchar *src, qsizetype count, void *dest)
+    {
+        if (BigEndian) {
+            qFromBigEndian<T>(src, count, dest);
+        } else {
+            qFromLittleEndian<T>(src, count, dest);
+        }
+    }
+
+    static inline float loadFloat(const uchar *src)
+    {
+        quint32 bits = load<quint32>(src);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static inline double loadDouble(const uchar *src)
+    {
+        quint64 bits = load<quint64>(src);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static inline uint64_t loadAddress(const uchar *src)
+    {
+        return PtrSize == 4 ? load<quint32>(src) : load<quint64>(src);
+    }
+};
+
+/*
+ * Calls function with the Decoder for the byte order and pointer size of
+ * a file.
+ */
+template<typename F>
+inline void withDecoder(bool bigEndian, int pointerSize, F function)
+{
+    if (bigEndian) {
+        if (pointerSize == 4) {
+            function(Decoder<true, 4>());
+        } else {
+            function(Decoder<true, 8>());
+        }
+    } else {
+        if (pointerSize == 4) {
+            function(Decoder<false, 4>());
+        } else {
+            function(Decoder<false, 8>());
+        }
+    }
+}
+
+#endif // BLENDINPUT_H
@@ -0,0 +1,259 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "blendserver.h"
+#include "blenderror.h"
+#include "blendtoxml.h"
+#include "blockindex.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QLocalSocket>
+#include <QMutexLocker>
+#include <QRunnable>
+
+// Connections served at once; further clients wait for a free thread
+static const int MaxConnections = 64;
+// A connection without requests for this long is closed
+static const int IdleTimeout = 60000;
+// Longest request line
+static const qint64 MaxRequest = 64 << 10;
+// Output waiting for a slow client before the conversion waits as well
+static const qint64 MaxPending = 4 << 20;
+
+/*
+ * The device and the loaded file of a cache entry. Requests convert copies
+ * of file, which share its tables and input; those of a source that is not
+ * in memory take turns, as its input reads forward.
+ */
+struct BlendServer::CachedFile
+{
+    QString path;
+    qint64 size;
+    QDateTime modified;
+    QFile device;
+    std::unique_ptr<BlendFile> file;
+    QMutex mutex;
+};
+
+class BlendServer::Connection : public QRunnable
+{
+public:
+    Connection(BlendServer *server, quintptr socketDescriptor)
+        : m_server(server), m_socketDescriptor(socketDescriptor) {}
+
+    void run() { m_server->serve(m_socketDescriptor); }
+
+private:
+    BlendServer *m_server;
+    quintptr m_socketDescriptor;
+};
+
+/*
+ * Sends what the converter writes to the client as it comes, so that an
+ * answer is never held in memory as a whole. "OK\n" goes out with the
+ * first chunk.
+ */
+class BlendServer::ChunkedOutput : public QIODevice
+{
+public:
+    explicit ChunkedOutput(QLocalSocket *socket) : m_socket(socket), m_started(false) {}
+
+    bool started() const { return m_started; }
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *data, qint64 len)
+    {
+        // An empty chunk would end the answer
+        if (len <= 0) {
+            return 0;
+        }
+        if (!m_started) {
+            m_socket->write("OK\n");
+            m_started = true;
+        }
+        m_socket->write(QByteArray::number(len) + "\n");
+        m_socket->write(data, len);
+        while (m_socket->bytesToWrite() > MaxPending) {
+            if (!m_socket->waitForBytesWritten(IdleTimeout)) {
+                return -1;
+            }
+        }
+        return len;
+    }
+
+private:
+    QLocalSocket *m_socket;
+    bool m_started;
+};
+
+BlendServer::BlendServer(const TaskFactory &factory, int cacheSize, QObject *parent)
+    : QLocalServer(parent), m_factory(factory), m_cacheSize(cacheSize)
+{
+    m_pool.setMaxThreadCount(MaxConnections);
+}
+
+BlendServer::~BlendServer()
+{
+    close();
+    m_pool.waitForDone();
+}
+
+void BlendServer::setCachePath(const QString &directory)
+{
+    m_cachePath = directory;
+}
+
+void BlendServer::incomingConnection(quintptr socketDescriptor)
+{
+    m_pool.start(new Connection(this, socketDescriptor));
+}
+
+void BlendServer::serve(quintptr socketDescriptor)
+{
+    QLocalSocket socket;
+    if (!socket.setSocketDescriptor(socketDescriptor)) {
+        return;
+    }
+
+    while (socket.state() == QLocalSocket::ConnectedState) {
+        if (!socket.canReadLine()) {
+            if (socket.bytesAvailable() > MaxRequest || !socket.waitForReadyRead(IdleTimeout)) {
+                break;
+            }
+            continue;
+        }
+
+        QByteArray request = socket.readLine();
+        while (request.endsWith('\n') || request.endsWith('\r')) {
+            request.chop(1);
+        }
+        if (request.isEmpty()) {
+            continue;
+        }
+
+        answer(socket, request);
+        while (socket.bytesToWrite() > 0) {
+            if (!socket.waitForBytesWritten(IdleTimeout)) {
+                return;
+            }
+        }
+    }
+}
+
+void BlendServer::answer(QLocalSocket &socket, const QByteArray &request)
+{
+    QList<QByteArray> fields = request.split('\t');
+    const QByteArray command = fields.takeFirst();
+    if ((command != "dump" && command != "list" && command != "summary") || fields.isEmpty()) {
+        socket.write("ERROR expected dump, list or summary, a path and patterns, separated by tabs\n");
+        return;
+    }
+
+    const QString path = QString::fromUtf8(fields.takeFirst());
+    QStringList selection;
+    for (const QByteArray &pattern : fields) {
+        selection.append(QString::fromUtf8(pattern));
+    }
+
+    ChunkedOutput output(&socket);
+    output.open(QIODevice::WriteOnly);
+    QString error;
+    try {
+        std::shared_ptr<CachedFile> cached = cachedFile(path);
+
+        std::unique_ptr<BlendToXml> task(m_factory(&output));
+        task->setFile(*cached->file);
+        task->setSelection(selection);
+        task->setSummary(command == "summary");
+        task->setHeadersOnly(command == "list");
+
+        QMutexLocker locker(cached->file->isInMemory() ? nullptr : &cached->mutex);
+        task->run();
+        error = task->errorString();
+    } catch (const BlendError &e) {
+        error = e.message();
+    }
+
+    if (!error.isEmpty()) {
+        socket.write("ERROR " + error.toUtf8().replace('\n', ' ') + "\n");
+        return;
+    }
+    if (!output.started()) {
+        socket.write("OK\n");
+    }
+    socket.write("0\n");
+}
+
+/*
+ * Returns the cache entry of path, loading the file if it is not cached
+ * or changed since. Files are loaded without holding the lock, so a slow
+ * load does not hold up requests for other files.
+ */
+std::shared_ptr<BlendServer::CachedFile> BlendServer::cachedFile(const QString &path)
+{
+    const QFileInfo info(path);
+    const QString key = info.absoluteFilePath();
+    {
+        QMutexLocker locker(&m_mutex);
+        for (int i = 0; i < m_files.length(); i++) {
+            std::shared_ptr<CachedFile> cached = m_files.at(i);
+            if (cached->path != key) {
+                continue;
+            }
+            m_files.removeAt(i);
+            if (cached->size == info.size() && cached->modified == info.lastModified()) {
+                m_files.prepend(cached);
+                return cached;
+            }
+            break;
+        }
+    }
+
+    std::shared_ptr<CachedFile> cached(new CachedFile);
+    cached->path = key;
+    cached->size = info.size();
+    cached->modified = info.lastModified();
+    cached->device.setFileName(path);
+    if (!cached->device.open(QIODevice::ReadOnly)) {
+        blendError("open: %s", qPrintable(cached->device.errorString()));
+    }
+    cached->file.reset(new BlendFile(&cached->device));
+    cached->file->setIndexPath(BlockIndex::pathFor(path));
+    cached->file->setCachePath(m_cachePath);
+    cached->file->setSharedCache(&m_dnaCache);
+    cached->file->load();
+    // Done once here, so that --select requests do not copy the block table
+    cached->file->readIdNames();
+
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < m_files.length(); i++) {
+        if (m_files.at(i)->path == key) {
+            m_files.removeAt(i);
+            break;
+        }
+    }
+    m_files.prepend(cached);
+    while (m_files.length() > m_cacheSize) {
+        m_files.removeLast();
+    }
+    return cached;
+}
@@ -0,0 +1,89 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLENDSERVER_H
+#define BLENDSERVER_H
+
+#include <functional>
+#include <memory>
+
+#include <QByteArray>
+#include <QList>
+#include <QLocalServer>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+
+#include "dnacache.h"
+
+class BlendToXml;
+class QIODevice;
+class QLocalSocket;
+
+/*
+ * Answers requests for .blend files on a local socket, with the block
+ * tables and SDNA of the most recently used files kept loaded. A cached
+ * file is loaded again when its size or modification time changes. A
+ * request is one line of tab separated fields,
+ *
+ *     dump      path [pattern...]    the blocks, all of them without patterns
+ *     list      path [pattern...]    only the headers of the blocks
+ *     summary   path [pattern...]    the blocks per code and structure type
+ *
+ * where the patterns select blocks like --select. It is answered with
+ * "OK\n" and the document in chunks of "<bytes>\n" and the bytes, ended by
+ * "0\n", or with "ERROR <message>\n", which may also take the place of a
+ * chunk if the conversion fails halfway. A client may send any number of
+ * requests on one connection; every connection is served on its own
+ * thread.
+ */
+class BlendServer : public QLocalServer
+{
+public:
+    // Creates the converter of a request, with the options of the server
+    typedef std::function<BlendToXml *(QIODevice *out)> TaskFactory;
+
+    BlendServer(const TaskFactory &factory, int cacheSize, QObject *parent = 0);
+    ~BlendServer();
+
+    void setCachePath(const QString &directory);
+
+protected:
+    void incomingConnection(quintptr socketDescriptor);
+
+private:
+    struct CachedFile;
+    class Connection;
+    class ChunkedOutput;
+
+    TaskFactory m_factory;
+    int m_cacheSize;
+    QString m_cachePath;
+    SharedDnaCache m_dnaCache;
+
+    QMutex m_mutex;
+    QList<std::shared_ptr<CachedFile>> m_files;    // most recently used first
+    QThreadPool m_pool;
+
+    void serve(quintptr socketDescriptor);
+    void answer(QLocalSocket &socket, const QByteArray &request);
+    std::shared_ptr<CachedFile> cachedFile(const QString &path);
+};
+
+#endif // BLENDSERVER_H
@@ -18,424 +18,1984 @@
  */
 
 #include "blendtoxml.h"
+#include "blendinput.h"
+#include "xmlwriter.h"
+#include "packwriter.h"
+#include "addressindex.h"
+#include "readahead.h"
+#include "blenderror.h"
+#include "xxhash64.h"
 
-#include <memory>
-#include <QRegExp>
-#include <QXmlStreamWriter>
-#include <QRegularExpression>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QVarLengthArray>
+#include <QWaitCondition>
+#include <QtAlgorithms>
+#include <qsimd.h>      // also defines __SSE2__ for MSVC on x86-64
 
-CombType::CombType(const QString &name)
-    : isPointer(false), width(1), height(1)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+class FunctionTask : public QRunnable
+{
+public:
+    explicit FunctionTask(const std::function<void()> &function) : function(function) {}
+    void run() { function(); }
+
+private:
+    std::function<void()> function;
+};
+
+static const QByteArray ElemTag = QByteArrayLiteral("elem");
+
+// BlockChunk::sameAs of a block that repeats no other
+static const uint32_t NotDuplicate = 0xFFFFFFFF;
+
+// Default of setReadAhead()
+static const qint64 DefaultReadAhead = 64 << 20;
+
+// Milliseconds between two progress() signals
+static const qint64 ProgressInterval = 1000;
+
+/*
+ * Lookup tables for char arrays: which bytes count as printable, the two
+ * hex digits of a byte and its escape in mixed mode, where XML markup
+ * characters are escaped as well. Printable is decided by the same test as
+ * always; where char is signed, toLatin1() never equals a byte above ASCII.
+ */
+struct CharTables
+{
+    bool printable[256];
+    char hex[256][2];
+    struct Escape
+    {
+        char text[7];   // copied whole, only length bytes are kept
+        uchar length;
+    } escapes[256];
+
+    CharTables()
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (int c = 0; c < 256; c++) {
+            const uint8_t byte = static_cast<uint8_t>(c);
+            const QChar qc(byte);
+            printable[c] = qc.toLatin1() == byte && qc.isPrint();
+            hex[c][0] = digits[c >> 4];
+            hex[c][1] = digits[c & 15];
+
+            Escape &escape = escapes[c];
+            memset(escape.text, 0, sizeof(escape.text));
+            const char *text = nullptr;
+            switch (c) {
+            case '\0': text = "\\0"; break;
+            case '\\': text = "\\\\"; break;
+            case '<': text = "&lt;"; break;
+            case '>': text = "&gt;"; break;
+            case '&': text = "&amp;"; break;
+            case '"': text = "&quot;"; break;
+            }
+            if (text) {
+                escape.length = static_cast<uchar>(strlen(text));
+                memcpy(escape.text, text, escape.length);
+            } else if (c >= 0x20 && c < 0x7F) {
+                escape.text[0] = static_cast<char>(c);
+                escape.length = 1;
+            } else {
+                escape.text[0] = '\\';
+                escape.text[1] = static_cast<char>('0' + (c >> 6));
+                escape.text[2] = static_cast<char>('0' + ((c >> 3) & 7));
+                escape.text[3] = static_cast<char>('0' + (c & 7));
+                escape.length = 4;
+            }
+        }
+    }
+};
+
+static const CharTables &charTables()
+{
+    static const CharTables tables;
+    return tables;
+}
+
+// The first byte from p on that is not printable ASCII, or end
+static const uchar *asciiPrintableEnd(const uchar *p, const uchar *end)
+{
+#ifdef __SSE2__
+    // Bytes from 0x80 on are negative, so two signed compares suffice
+    const __m128i low = _mm_set1_epi8(0x1F);
+    const __m128i high = _mm_set1_epi8(0x7F);
+    for (; end - p >= 16; p += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const int printable = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high)));
+        if (printable != 0xFFFF) {
+            return p + qCountTrailingZeroBits(static_cast<quint32>(~printable));
+        }
+    }
+#endif
+    while (p < end && *p >= 0x20 && *p < 0x7F) {
+        p++;
+    }
+    return p;
+}
+
+static bool isZero(const uchar *p, const uchar *end)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; end - p >= 16; p += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isAscii(const char *text, int len)
+{
+    auto p = reinterpret_cast<const uchar *>(text);
+    const uchar *end = p + len;
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)))) {
+            return false;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BlendToXml::BlendToXml(QIODevice *in, QIODevice *out, bool notypes, bool nodata, bool printRawPointers, QObject *parent) :
+    QObject(parent), m_in(in), m_out(out),
+    notypes(notypes), nodata(nodata), printRawPointers(printRawPointers), jobs(1), streaming(false), buildIndex(false), references(false), format(Xml), readAhead(DefaultReadAhead), deduplication(NoDeduplication), sharedCache(nullptr), diffBase(nullptr), summary(false), headersOnly(false), phaseTimes(),
+    collectStats(false), stats(), nextProgress(0), totalBytes(0), file(in)
+{}
+
+BlendToXml::~BlendToXml()
+{}
+
+const PhaseTimings &BlendToXml::timings() const
+{
+    return phaseTimes;
+}
+
+const ConversionStats &BlendToXml::statistics() const
+{
+    return stats;
+}
+
+QString BlendToXml::errorString() const
+{
+    return errorMessage;
+}
+
+void BlendToXml::setJobs(int jobs)
+{
+    this->jobs = jobs;
+}
+
+void BlendToXml::setStreaming(bool streaming)
+{
+    this->streaming = streaming;
+}
+
+void BlendToXml::setIndexPath(const QString &path)
+{
+    indexPath = path;
+}
+
+void BlendToXml::setCachePath(const QString &directory)
+{
+    cachePath = directory;
+}
+
+void BlendToXml::setSharedCache(SharedDnaCache *cache)
+{
+    sharedCache = cache;
+}
+
+void BlendToXml::setBuildIndex(bool buildIndex)
+{
+    this->buildIndex = buildIndex;
+}
+
+void BlendToXml::setSelection(const QStringList &selection)
+{
+    this->selection = selection;
+    selectedIndexes.clear();
+    for (const QString &pattern : selection) {
+        bool isIndex = false;
+        uint32_t index = pattern.startsWith(QLatin1Char('#')) ? pattern.mid(1).toUInt(&isIndex) : 0;
+        if (isIndex) {
+            selectedIndexes.append(index);
+        }
+    }
+}
+
+void BlendToXml::setReferences(bool references)
+{
+    this->references = references;
+}
+
+void BlendToXml::setFormat(Format format)
+{
+    this->format = format;
+}
+
+void BlendToXml::setFields(const QStringList &paths)
+{
+    fieldPaths = paths;
+}
+
+void BlendToXml::setFile(const BlendFile &loaded)
+{
+    file = loaded;
+}
+
+void BlendToXml::setReadAhead(qint64 bytes)
+{
+    readAhead = bytes;
+}
+
+void BlendToXml::setDeduplication(Deduplication deduplication)
+{
+    this->deduplication = deduplication;
+}
+
+void BlendToXml::setStatistics(bool statistics)
+{
+    collectStats = statistics;
+}
+
+void BlendToXml::setDiffBase(QIODevice *base)
+{
+    diffBase = base;
+}
+
+void BlendToXml::setSummary(bool summary)
+{
+    this->summary = summary;
+}
+
+void BlendToXml::setHeadersOnly(bool headersOnly)
+{
+    this->headersOnly = headersOnly;
+}
+
+void BlendToXml::run()
+{
+    try {
+        convertDocument();
+    } catch (const BlendError &error) {
+        errorMessage = error.message();
+    }
+
+    file.close();
+
+    emit finished();
+}
+
+void BlendToXml::convertDocument()
+{
+    // A file given to setFile() is open and loaded already
+    if (!file.isOpen()) {
+        configureFile(file);
+        // The index only helps to find the blocks of a --select query, or
+        // replaces the scan of a summary or a listing
+        if (!buildIndex && (!selection.isEmpty() || summary || headersOnly)) {
+            file.setIndexPath(indexPath);
+        }
+        file.open();
+    }
+    QByteArray header = file.header();
+
+    if (diffBase) {
+        XmlWriter out(m_out);
+        writeDiffDocument(out, header);
+        return;
+    }
+
+    if (summary) {
+        if (format == MessagePack) {
+            PackWriter out(m_out);
+            writeSummaryDocument(out, header);
+        } else {
+            XmlWriter out(m_out);
+            writeSummaryDocument(out, header);
+        }
+        return;
+    }
+
+    // --index only writes the sidecar file, the document goes nowhere
+    QIODevice *device = buildIndex ? nullptr : m_out;
+    if (format == MessagePack) {
+        PackWriter out(device);
+        writeDocument(out, header);
+    } else {
+        XmlWriter out(device);
+        writeDocument(out, header);
+    }
+}
+
+void BlendToXml::writeDocument(XmlWriter &out, const QByteArray &header)
+{
+    out.writeStartDocument();
+
+    out.writeStartElement("blend");
+    out.writeAttribute("identifier", header.left(7));
+    out.writeAttribute("pointer-size", QByteArray::number(file.pointerSize()));
+    out.writeAttribute("endianness", header.mid(8, 1));
+    out.writeAttribute("version-number", QString::fromLatin1(header.constData() + 9, 3));
+
+    withDecoder(file.isBigEndian(), file.pointerSize(), [&](auto decoder) { convert<decltype(decoder)>(out); });
+
+    out.writeEndElement();
+    out.writeEndDocument();
+}
+
+/*
+ * The binary document is a sequence of MessagePack objects: a map with the
+ * file header, the schema, then one map per block.
+ */
+void BlendToXml::writeDocument(PackWriter &out, const QByteArray &header)
+{
+    out.writeMap(5);
+    out.writeString("format");
+    out.writeString("blend2xml");
+    out.writeString("identifier");
+    out.writeString(header.left(7));
+    out.writeString("pointer-size");
+    out.writeUInt(file.pointerSize());
+    out.writeString("endianness");
+    out.writeString(header.mid(8, 1));
+    out.writeString("version-number");
+    out.writeString(QString::fromLatin1(header.constData() + 9, 3));
+
+    withDecoder(file.isBigEndian(), file.pointerSize(), [&](auto decoder) { convert<decltype(decoder)>(out); });
+
+    out.flush();
+}
+
+/*
+ * The diff document has the root element <blend-diff> with the versions of
+ * both files, followed by the blocks that changed, without <types>.
+ */
+void BlendToXml::writeDiffDocument(XmlWriter &out, const QByteArray &header)
+{
+    BlendFile old(diffBase);
+    configureFile(old);
+    old.open();
+
+    QByteArray oldHeader = old.header();
+    if (oldHeader.mid(7, 2) != header.mid(7, 2)) {
+        blendError("Cannot compare files with different pointer sizes or byte orders");
+    }
+
+    // Block indices are not comparable between two files
+    references = false;
+
+    out.writeStartDocument();
+
+    out.writeStartElement("blend-diff");
+    out.writeAttribute("identifier", header.left(7));
+    out.writeAttribute("pointer-size", QByteArray::number(file.pointerSize()));
+    out.writeAttribute("endianness", header.mid(8, 1));
+    out.writeAttribute("old-version-number", QString::fromLatin1(oldHeader.constData() + 9, 3));
+    out.writeAttribute("new-version-number", QString::fromLatin1(header.constData() + 9, 3));
+
+    withDecoder(file.isBigEndian(), file.pointerSize(), [&](auto decoder) { diff<decltype(decoder)>(out, old); });
+
+    out.writeEndElement();
+    out.writeEndDocument();
+}
+
+/*
+ * The summary document has the root element <blend-summary> with the
+ * totals of the file, a <code> element per block code and in it a
+ * <structure> element per structure type, the largest first.
+ */
+void BlendToXml::writeSummaryDocument(XmlWriter &out, const QByteArray &header)
+{
+    QList<SummaryEntry> entries = summarize();
+    quint64 fileBlocks = 0, fileBytes = 0;
+    for (const SummaryEntry &entry : entries) {
+        fileBlocks += entry.blocks;
+        fileBytes += entry.bytes;
+    }
+
+    out.writeStartDocument();
+
+    out.writeStartElement("blend-summary");
+    out.writeAttribute("identifier", header.left(7));
+    out.writeAttribute("pointer-size", QByteArray::number(file.pointerSize()));
+    out.writeAttribute("endianness", header.mid(8, 1));
+    out.writeAttribute("version-number", QString::fromLatin1(header.constData() + 9, 3));
+    out.writeAttribute("blocks", static_cast<uint64_t>(fileBlocks));
+    out.writeAttribute("bytes", static_cast<uint64_t>(fileBytes));
+
+    for (int begin = 0, end; begin < entries.length(); begin = end) {
+        quint64 codeBlocks = 0, codeBytes = 0;
+        for (end = begin; end < entries.length() && memcmp(entries[end].code, entries[begin].code, 4) == 0; end++) {
+            codeBlocks += entries[end].blocks;
+            codeBytes += entries[end].bytes;
+        }
+
+        out.writeStartElement("code");
+        out.writeAttribute("name", entries[begin].code, static_cast<int>(qstrnlen(entries[begin].code, 4)));
+        out.writeAttribute("blocks", static_cast<uint64_t>(codeBlocks));
+        out.writeAttribute("bytes", static_cast<uint64_t>(codeBytes));
+        for (int i = begin; i < end; i++) {
+            const SummaryEntry &entry = entries[i];
+            out.writeStartElement("structure");
+            out.writeAttribute("type", file.layouts().at(entry.structure).tag);
+            out.writeAttribute("blocks", static_cast<uint64_t>(entry.blocks));
+            out.writeAttribute("elements", static_cast<uint64_t>(entry.elements));
+            out.writeAttribute("bytes", static_cast<uint64_t>(entry.bytes));
+            out.writeAttribute("largest", static_cast<uint64_t>(entry.largest));
+            out.writeEndElement();
+        }
+        out.writeEndElement();
+    }
+
+    out.writeEndElement();
+    out.writeEndDocument();
+}
+
+/*
+ * The binary summary is one map with the file header, the totals and
+ * "codes", an array of [code, structure type, blocks, elements, bytes,
+ * largest] rows in the order of the XML summary.
+ */
+void BlendToXml::writeSummaryDocument(PackWriter &out, const QByteArray &header)
+{
+    QList<SummaryEntry> entries = summarize();
+    quint64 fileBlocks = 0, fileBytes = 0;
+    for (const SummaryEntry &entry : entries) {
+        fileBlocks += entry.blocks;
+        fileBytes += entry.bytes;
+    }
+
+    out.writeMap(8);
+    out.writeString("format");
+    out.writeString("blend2xml-summary");
+    out.writeString("identifier");
+    out.writeString(header.left(7));
+    out.writeString("pointer-size");
+    out.writeUInt(file.pointerSize());
+    out.writeString("endianness");
+    out.writeString(header.mid(8, 1));
+    out.writeString("version-number");
+    out.writeString(QString::fromLatin1(header.constData() + 9, 3));
+    out.writeString("blocks");
+    out.writeUInt(fileBlocks);
+    out.writeString("bytes");
+    out.writeUInt(fileBytes);
+
+    out.writeString("codes");
+    out.writeArray(static_cast<uint32_t>(entries.length()));
+    for (const SummaryEntry &entry : entries) {
+        out.writeArray(6);
+        out.writeString(entry.code, static_cast<int>(qstrnlen(entry.code, 4)));
+        out.writeString(file.layouts().at(entry.structure).tag);
+        out.writeUInt(entry.blocks);
+        out.writeUInt(entry.elements);
+        out.writeUInt(entry.bytes);
+        out.writeUInt(entry.largest);
+    }
+
+    out.flush();
+}
+
+/*
+ * Adds up the block headers by code and structure type. Nothing but the
+ * headers and DNA1 is read, unless --select needs the ID names. The
+ * entries are sorted by code, and within a code by bytes.
+ */
+QList<BlendToXml::SummaryEntry> BlendToXml::summarize()
+{
+    file.load();
+    phaseTimes.scan = file.scanTime();
+    phaseTimes.dna = file.dnaTime();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (selection.isEmpty()) {
+        blocks = file.blocks();
+    } else {
+        file.readIdNames();
+        blocks.clear();
+        for (const Block &block : file.blocks()) {
+            if (isSelected(file, block)) {
+                blocks.append(block);
+            }
+        }
+    }
+
+    // Keyed by the code and the structure index
+    QHash<quint64, int> positions;
+    QList<SummaryEntry> entries;
+    for (const Block &block : blocks) {
+        quint32 code;
+        memcpy(&code, block.code, sizeof(code));
+        const quint64 key = (static_cast<quint64>(code) << 32) | block.sdnaIndex;
+
+        int position = positions.value(key, -1);
+        if (position < 0) {
+            SummaryEntry entry = {};
+            memcpy(entry.code, block.code, sizeof(entry.code));
+            entry.structure = block.sdnaIndex;
+            position = entries.length();
+            positions.insert(key, position);
+            entries.append(entry);
+        }
+        SummaryEntry &entry = entries[position];
+        entry.blocks++;
+        entry.elements += block.count;
+        entry.bytes += block.size;
+        entry.largest = qMax(entry.largest, block.size);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const SummaryEntry &a, const SummaryEntry &b) {
+        int order = memcmp(a.code, b.code, sizeof(a.code));
+        return order != 0 ? order < 0 : a.bytes > b.bytes;
+    });
+
+    startStats();
+    if (collectStats) {
+        for (const Block &block : blocks) {
+            countBlock(block, 0, true);
+        }
+    }
+    finishStats();
+
+    phaseTimes.data = timer.nsecsElapsed();
+    return entries;
+}
+
+void BlendToXml::configureFile(BlendFile &file) const
+{
+    file.setStreaming(streaming);
+    file.setCachePath(cachePath);
+    file.setSharedCache(sharedCache);
+}
+
+template<typename D, typename W>
+void BlendToXml::convert(W &out)
+{
+    file.load();
+    phaseTimes.scan = file.scanTime();
+    phaseTimes.dna = file.dnaTime();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (buildIndex) {
+        file.readIdNames();
+        file.saveIndex(indexPath);
+        return;
+    }
+
+    compileFields();
+
+    if (references) {
+        addresses.reset(new AddressIndex);
+        addresses->build(file.blocks(), file.layouts());
+    }
+
+    if (!selection.isEmpty() || headersOnly) {
+        file.readIdNames();
+    }
+    if (selection.isEmpty()) {
+        blocks = file.blocks();
+    } else {
+        blocks.clear();
+        for (const Block &block : file.blocks()) {
+            if (isSelected(file, block)) {
+                blocks.append(block);
+            }
+        }
+    }
+    phaseTimes.data = timer.nsecsElapsed();
+    timer.start();
+
+    printTypes(out);
+    phaseTimes.types = timer.nsecsElapsed();
+    timer.start();
+
+    if (headersOnly) {
+        startStats();
+        for (const Block &block : blocks) {
+            printHeader(out, block);
+            if (collectStats) {
+                countBlock(block, 0, true);
+            }
+        }
+        finishStats();
+    } else if (!nodata) {
+        startStats();
+        startDeduplication();
+        ReadAhead reader(file, blocks, readAhead);
+        if (jobs > 1 && blocks.length() > 1) {
+            printBlocksParallel<D>(out, reader);
+        } else {
+            for (int i = 0; i < blocks.length(); i++) {
+                const Block &block = blocks[i];
+                qint64 start = collectStats ? timer.nsecsElapsed() : 0;
+                QByteArray data = reader.next();
+                uint32_t sameAs = duplicateOf(block, data);
+                if (sameAs != NotDuplicate) {
+                    printDuplicate(out, block, sameAs);
+                } else {
+                    printBlock<D>(out, block, data, 0, file.elementCount(block));
+                }
+                reader.release(i + 1);
+                if (collectStats) {
+                    countBlock(block, timer.nsecsElapsed() - start, true);
+                }
+            }
+        }
+        finishStats();
+    }
+    phaseTimes.data += timer.nsecsElapsed();
+}
+
+/*
+ * Statistics cost a clock read and a few additions per block, so they
+ * can stay enabled on the largest files.
+ */
+void BlendToXml::startStats()
+{
+    stats = ConversionStats();
+    if (!collectStats) {
+        return;
+    }
+
+    TypeStats empty = {};
+    typeStats.fill(empty, file.structures().length());
+    totalBytes = 0;
+    for (const Block &block : blocks) {
+        totalBytes += block.size;
+    }
+    progressTimer.start();
+    nextProgress = ProgressInterval;
+}
+
+// Blocks printed in several chunks are counted with their first chunk
+void BlendToXml::countBlock(const Block &block, qint64 time, bool firstChunk)
+{
+    TypeStats &type = typeStats[block.sdnaIndex];
+    type.time += time;
+    if (firstChunk) {
+        type.blocks++;
+        type.bytes += block.size;
+        stats.blocks++;
+        stats.bytes += block.size;
+    }
+
+    if (progressTimer.elapsed() >= nextProgress) {
+        nextProgress = progressTimer.elapsed() + ProgressInterval;
+        emit progress(static_cast<qint64>(stats.bytes), totalBytes);
+    }
+}
+
+void BlendToXml::finishStats()
 {
-    isPointer = name.startsWith('*');
+    for (int i = 0; i < typeStats.length(); i++) {
+        if (typeStats[i].blocks) {
+            TypeStats type = typeStats[i];
+            type.type = file.layouts().at(i).tag;
+            stats.types.append(type);
+        }
+    }
+    typeStats.clear();
+}
+
+void BlendToXml::printTypes(XmlWriter &out)
+{
+    if (notypes) {
+        return;
+    }
+
+    out.writeStartElement("types");
+    for (int i = 0; i < file.typeNames().length(); i++) {
+        out.writeStartElement("type");
+        out.writeAttribute("name", file.typeNames()[i]);
+        out.writeAttribute("length", QString::number(file.typeLengths()[i]));
+        out.writeEndElement();
+    }
+    out.writeEndElement();
+
+    out.writeStartElement("structures");
+    for (const auto &structure : file.structures()) {
+        out.writeStartElement("structure");
+        out.writeAttribute("type", file.typeNames()[structure.type]);
+        out.writeAttribute("size", QString::number(file.typeLengths()[structure.type]));
+        for (const auto &field : structure.fields) {
+            out.writeStartElement("field");
+            out.writeAttribute("type", file.typeNames()[field.type]);
+            out.writeAttribute("name", file.names()[field.name]);
+            out.writeEndElement();
+        }
+        out.writeEndElement();
+    }
+    out.writeEndElement();
+}
+
+/*
+ * The schema is needed to decode the blocks, so it is written even with
+ * --notypes. Fields are listed in file order, pad fields included: every
+ * structure in the data is an array with one entry per field, nil for pads.
+ */
+void BlendToXml::printTypes(PackWriter &out)
+{
+    static const char *const kindNames[] = {
+        "empty", "char", "int8", "int16", "int32", "int64", "float", "double", "pointer", "struct"
+    };
+
+    out.writeMap(2);
+    out.writeString("types");
+    out.writeArray(file.typeNames().length());
+    for (int i = 0; i < file.typeNames().length(); i++) {
+        out.writeArray(2);
+        out.writeString(file.typeNames()[i]);
+        out.writeUInt(file.typeLengths()[i]);
+    }
+
+    out.writeString("structures");
+    out.writeArray(file.structures().length());
+    for (int i = 0; i < file.structures().length(); i++) {
+        const Structure &structure = file.structures()[i];
+        const StructLayout &layout = file.layouts()[i];
+        out.writeMap(3);
+        out.writeString("type");
+        out.writeString(file.typeNames()[structure.type]);
+        out.writeString("size");
+        out.writeUInt(layout.size);
+        out.writeString("fields");
+        out.writeArray(structure.fields.length());
+        for (int j = 0; j < structure.fields.length(); j++) {
+            const FieldLayout &field = layout.fields[j];
+            bool isStruct = field.kind == FieldLayout::Struct;
+            out.writeMap(isStruct ? 8 : 7);
+            out.writeString("type");
+            out.writeString(file.typeNames()[field.type]);
+            out.writeString("name");
+            out.writeString(file.names()[structure.fields[j].name]);
+            out.writeString("tag");
+            out.writeString(field.tag);
+            out.writeString("print-type");
+            out.writeString(field.printType);
+            out.writeString("kind");
+            out.writeString(kindNames[field.kind]);
+            out.writeString("count");
+            out.writeUInt(field.width * field.height);
+            out.writeString("pad");
+            out.writeBool(field.isPad);
+            if (isStruct) {
+                out.writeString("structure");
+                out.writeUInt(field.structure);
+            }
+        }
+    }
+}
+
+/*
+ * A pattern matches the block code ("OB"), the structure type ("Object"),
+ * the ID name with or without its code prefix ("OBCube", "Cube") or the
+ * block index after a '#' ("#12", as written by --list).
+ */
+bool BlendToXml::isSelected(const BlendFile &source, const Block &block) const
+{
+    if (selectedIndexes.contains(block.index)) {
+        return true;
+    }
+    const QLatin1String type = source.typeName(block);
+    const QLatin1String idName = source.idName(block);
+    for (const QString &pattern : selection) {
+        if (pattern == block.name() || pattern == type) {
+            return true;
+        }
+        if (!idName.isEmpty() && (pattern == idName || pattern == idName.mid(qMin(2, idName.size())))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlendToXml::startDeduplication()
+{
+    firstBlocks.clear();
+    pointerOffsets.clear();
+    if (deduplication != SameValues) {
+        return;
+    }
+
+    pointerOffsets.resize(file.layouts().length());
+    for (int i = 0; i < file.layouts().length(); i++) {
+        collectPointers(static_cast<uint32_t>(i), 0, pointerOffsets[i]);
+    }
+}
+
+// Offsets of all pointers in a structure, including those of nested structures
+void BlendToXml::collectPointers(uint32_t structure, uint32_t base, QVector<uint32_t> &offsets) const
+{
+    for (const FieldLayout &field : file.layouts().at(structure).fields) {
+        const uint32_t count = field.width * field.height;
+        if (field.kind == FieldLayout::Pointer) {
+            for (uint32_t i = 0; i < count; i++) {
+                offsets.append(base + field.offset + i * file.pointerSize());
+            }
+        } else if (field.kind == FieldLayout::Struct) {
+            const uint32_t size = file.layouts().at(field.structure).size;
+            for (uint32_t i = 0; i < count; i++) {
+                collectPointers(field.structure, base + field.offset + i * size, offsets);
+            }
+        }
+    }
+}
+
+/*
+ * Returns the index of an earlier block with the same structure, count and
+ * contents, or NotDuplicate and remembers this block as the first of its
+ * contents. Blocks are found by their XXH64 hash and then compared, so a
+ * hash collision is never written as a reference. For SameValues, non-NULL
+ * pointers are compared and hashed as 1 whatever their value.
+ */
+uint32_t BlendToXml::duplicateOf(const Block &block, const QByteArray &data)
+{
+    if (deduplication == NoDeduplication) {
+        return NotDuplicate;
+    }
+
+    const uint64_t seed = (static_cast<uint64_t>(block.sdnaIndex) << 32) ^ block.count;
+    const QByteArray &values = maskPointers(block, data, maskedValues);
+    const uint64_t hash = xxHash64(values.constData(), values.size(), seed);
+
+    auto it = firstBlocks.constFind(hash);
+    if (it != firstBlocks.constEnd()) {
+        const FirstBlock &first = it.value();
+        if (first.structure != block.sdnaIndex || first.count != block.count || first.data.size() != data.size()) {
+            return NotDuplicate;
+        }
+        const QByteArray &firstValues = maskPointers(block, first.data, maskedFirst);
+        return memcmp(firstValues.constData(), values.constData(), values.size()) == 0 ? first.index : NotDuplicate;
+    }
+
+    // Data read ahead is only valid until it is released, mapped data for
+    // as long as the file is open
+    FirstBlock entry = { block.index, block.sdnaIndex, block.count, data };
+    if (!file.isInMemory()) {
+        entry.data = QByteArray(data.constData(), data.size());
+    }
+    firstBlocks.insert(hash, entry);
+    return NotDuplicate;
+}
+
+/*
+ * The bytes of a block as SameValues compares them: each pointer is
+ * replaced by 0 for NULL and 1 otherwise. values is a reused scratch
+ * buffer; blocks without pointers are returned as they are.
+ */
+const QByteArray &BlendToXml::maskPointers(const Block &block, const QByteArray &data, QByteArray &values) const
+{
+    const QVector<uint32_t> *pointers = deduplication == SameValues ? &pointerOffsets[block.sdnaIndex] : nullptr;
+    if (!pointers || pointers->isEmpty()) {
+        return data;
+    }
+
+    const uint32_t size = file.layouts().at(block.sdnaIndex).size;
+    const int pointerSize = file.pointerSize();
+    const uint32_t count = qMin<uint32_t>(file.elementCount(block), static_cast<uint32_t>(data.size()) / size);
+    values.resize(data.size());
+    char *bytes = values.data();
+    memcpy(bytes, data.constData(), data.size());
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t offset : *pointers) {
+            char *pointer = bytes + i * size + offset;
+            const bool isNull = file.decodeAddress(reinterpret_cast<const uchar *>(pointer)) == 0;
+            memset(pointer, 0, pointerSize);
+            pointer[0] = isNull ? 0 : 1;
+        }
+    }
+    return values;
+}
+
+// The block header with the index of the block whose contents it repeats
+void BlendToXml::printDuplicate(XmlWriter &out, const Block &block, uint32_t sameAs)
+{
+    out.writeStartElement(file.layouts().at(block.sdnaIndex).tag);
+    out.writeAttribute("block", block.name());
+    if (printRawPointers) {
+        out.writeAttribute("old-memory-address", block.oldMemoryAddress, 16);
+    }
+    out.writeAttribute("index", block.index);
+    out.writeAttribute("same-as", sameAs);
+    out.writeEndElement();
+}
+
+void BlendToXml::printDuplicate(PackWriter &out, const Block &block, uint32_t sameAs)
+{
+    out.writeMap(4 + (printRawPointers ? 1 : 0));
+    out.writeString("block");
+    out.writeString(block.name());
+    out.writeString("structure");
+    out.writeUInt(block.sdnaIndex);
+    if (printRawPointers) {
+        out.writeString("old-memory-address");
+        out.writeUInt(block.oldMemoryAddress);
+    }
+    out.writeString("index");
+    out.writeUInt(block.index);
+    out.writeString("same-as");
+    out.writeUInt(sameAs);
+}
+
+/*
+ * A block without its contents: the attributes of printBlock() with the
+ * index, the ID name, the number of elements and the size in bytes.
+ */
+void BlendToXml::printHeader(XmlWriter &out, const Block &block)
+{
+    out.writeStartElement(file.layouts().at(block.sdnaIndex).tag);
+    out.writeAttribute("block", block.name());
+    if (printRawPointers) {
+        out.writeAttribute("old-memory-address", block.oldMemoryAddress, 16);
+    }
+    out.writeAttribute("index", block.index);
+    if (!file.idName(block).isEmpty()) {
+        out.writeAttribute("id", file.idName(block));
+    }
+    out.writeAttribute("elements", file.elementCount(block));
+    out.writeAttribute("size", block.size);
+    out.writeEndElement();
+}
+
+void BlendToXml::printHeader(PackWriter &out, const Block &block)
+{
+    const bool hasId = !file.idName(block).isEmpty();
+    out.writeMap(5 + (printRawPointers ? 1 : 0) + (hasId ? 1 : 0));
+    out.writeString("block");
+    out.writeString(block.name());
+    out.writeString("structure");
+    out.writeUInt(block.sdnaIndex);
+    if (printRawPointers) {
+        out.writeString("old-memory-address");
+        out.writeUInt(block.oldMemoryAddress);
+    }
+    out.writeString("index");
+    out.writeUInt(block.index);
+    if (hasId) {
+        out.writeString("id");
+        out.writeString(file.idName(block));
+    }
+    out.writeString("elements");
+    out.writeUInt(file.elementCount(block));
+    out.writeString("size");
+    out.writeUInt(block.size);
+}
+
+template<typename D>
+void BlendToXml::printBlock(XmlWriter &out, const Block &block, const QByteArray &data, uint32_t first, uint32_t last)
+{
+    const StructLayout &layout = file.layouts().at(block.sdnaIndex);
+    const int mask = structureMask(block.sdnaIndex);
+    auto bytes = reinterpret_cast<const uchar *>(data.constData());
+
+    if (first == 0) {
+        out.writeStartElement(layout.tag);
+        out.writeAttribute("block", block.name());
+
+        if (printRawPointers) {
+            out.writeAttribute("old-memory-address", block.oldMemoryAddress, 16);
+        }
+        if (references || deduplication != NoDeduplication) {
+            out.writeAttribute("index", block.index);
+        }
+    }
+
+    for (size_t i = first; i < last; i++) {
+        if (block.count != 1) {
+            out.writeStartElement(ElemTag);
+        }
+        printStructure<D>(out, bytes + i * layout.size, block.sdnaIndex, mask);
+        if (block.count != 1) {
+            out.writeEndElement();
+        }
+    }
+
+    if (last == file.elementCount(block)) {
+        out.writeEndElement();
+    }
+}
+
+template<typename D>
+void BlendToXml::printBlock(PackWriter &out, const Block &block, const QByteArray &data, uint32_t first, uint32_t last)
+{
+    const StructLayout &layout = file.layouts().at(block.sdnaIndex);
+    const int mask = structureMask(block.sdnaIndex);
+    auto bytes = reinterpret_cast<const uchar *>(data.constData());
+
+    if (first == 0) {
+        const bool index = references || deduplication != NoDeduplication;
+        out.writeMap(3 + (printRawPointers ? 1 : 0) + (index ? 1 : 0));
+        out.writeString("block");
+        out.writeString(block.name());
+        out.writeString("structure");
+        out.writeUInt(block.sdnaIndex);
+
+        if (printRawPointers) {
+            out.writeString("old-memory-address");
+            out.writeUInt(block.oldMemoryAddress);
+        }
+        if (index) {
+            out.writeString("index");
+            out.writeUInt(block.index);
+        }
+
+        out.writeString("elements");
+        out.writeArray(file.elementCount(block));
+    }
+
+    for (size_t i = first; i < last; i++) {
+        printStructure<D>(out, bytes + i * layout.size, block.sdnaIndex, mask);
+    }
+}
+
+/*
+ * Blocks are split into chunks of whole elements, formatted on a thread
+ * pool and written in file order. Each chunk is formatted by its own
+ * XmlWriter that continues the document inside the enclosing elements,
+ * so the result is byte-identical to the sequential output. The text
+ * buffers of written chunks are reset and handed to the next chunks, so
+ * a run allocates about as many as there are chunks in flight.
+ */
+template<typename D, typename W>
+void BlendToXml::printBlocksParallel(W &out, ReadAhead &reader)
+{
+    const qint64 chunkBytes = 1 << 20;
+
+    QVector<BlockChunk> chunks;
+    for (int i = 1; i < blocks.length(); i++) {
+        const Block &block = blocks[i];
+        uint32_t count = file.elementCount(block);
+        uint32_t size = file.layouts()[block.sdnaIndex].size;
+        uint32_t step = block.count != 1 && size ? qMax<uint32_t>(1, static_cast<uint32_t>(chunkBytes / size)) : count;
+
+        uint32_t first = 0;
+        do {
+            BlockChunk chunk;
+            chunk.block = i;
+            chunk.first = first;
+            chunk.last = qMin(count, first + qMax<uint32_t>(step, 1));
+            chunk.done = false;
+            chunk.sameAs = NotDuplicate;
+            chunk.time = 0;
+            chunks.append(chunk);
+            first = chunk.last;
+        } while (first < count);
+    }
+
+    QMutex mutex;
+    QWaitCondition formatted;
+    QVector<QByteArray> spare;
+    // Declared last, so that it waits for its tasks before what they use goes away
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+
+    const int window = jobs * 4;
+    int submitted = 0;
+
+    auto submit = [&]() {
+        BlockChunk &chunk = chunks[submitted++];
+        if (submitted > 1 && chunks[submitted - 2].block == chunk.block) {
+            chunk.data = chunks[submitted - 2].data;
+            chunk.sameAs = chunks[submitted - 2].sameAs;
+        } else {
+            chunk.data = reader.next();
+            chunk.sameAs = duplicateOf(blocks[chunk.block], chunk.data);
+        }
+
+        BlockChunk *target = &chunk;
+        pool.start(new FunctionTask([this, target, &mutex, &formatted, &spare]() {
+            QByteArray text;
+            {
+                QMutexLocker locker(&mutex);
+                if (!spare.isEmpty()) {
+                    text = spare.takeLast();
+                }
+            }
+            if (text.capacity() == 0) {
+                // Marks the capacity as reserved, so that resize(0) keeps it
+                text.reserve(static_cast<int>(chunkBytes));
+            }
+            QElapsedTimer timer;
+            timer.start();
+            formatChunk<D, W>(*target, text);
+            qint64 time = timer.nsecsElapsed();
+            QMutexLocker locker(&mutex);
+            target->text = std::move(text);
+            target->time = time;
+            target->done = true;
+            formatted.wakeAll();
+        }));
+    };
+
+    // The reader hands out blocks in order, the first one before the chunks
+    QByteArray firstData = reader.next();
+    duplicateOf(blocks.first(), firstData);
+    while (submitted < chunks.length() && submitted < window) {
+        submit();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    printBlock<D>(out, blocks.first(), firstData, 0, file.elementCount(blocks.first()));
+    if (collectStats) {
+        countBlock(blocks.first(), timer.nsecsElapsed(), true);
+    }
+
+    for (int i = 0; i < chunks.length(); i++) {
+        QByteArray text;
+        {
+            QMutexLocker locker(&mutex);
+            while (!chunks[i].done) {
+                formatted.wait(&mutex);
+            }
+            text.swap(chunks[i].text);
+            chunks[i].data.clear();
+        }
+        reader.release(chunks[i].block);
+
+        out.writeRaw(text);
+        text.resize(0);
+        {
+            QMutexLocker locker(&mutex);
+            spare.append(std::move(text));
+        }
+        if (collectStats) {
+            countBlock(blocks[chunks[i].block], chunks[i].time, chunks[i].first == 0);
+        }
+
+        while (submitted < chunks.length() && submitted < i + 1 + window) {
+            submit();
+        }
+    }
+
+    pool.waitForDone();
+}
+
+template<typename D, typename W>
+void BlendToXml::formatChunk(const BlockChunk &chunk, QByteArray &text)
+{
+    // A repeated block is a single reference, written with its first chunk
+    if (chunk.sameAs != NotDuplicate && chunk.first != 0) {
+        return;
+    }
+
+    W out(&text);
+    enterChunk(out, chunk);
+
+    if (chunk.sameAs != NotDuplicate) {
+        printDuplicate(out, blocks.at(chunk.block), chunk.sameAs);
+    } else {
+        printBlock<D>(out, blocks.at(chunk.block), chunk.data, chunk.first, chunk.last);
+    }
+}
 
-    if (isPointer) {
-        printType = "*";
+void BlendToXml::enterChunk(XmlWriter &out, const BlockChunk &chunk)
+{
+    out.enterElement("blend");
+    if (chunk.first != 0) {
+        const Block &block = blocks.at(chunk.block);
+        out.enterElement(file.layouts().at(block.sdnaIndex).tag);
     }
+}
 
-    QRegExp rx_name("^\\*?(\\w+)");
-    rx_name.indexIn(name);
-    shortname = rx_name.cap(1);
+void BlendToXml::enterChunk(PackWriter &, const BlockChunk &)
+{
+    // Containers are length prefixed, chunks need no context
+}
 
-    QRegExp rx_wh("\\[(\\d+)\\]\\[(\\d+)\\]");
-    if (rx_wh.indexIn(name) > -1) {
-        width = rx_wh.cap(1).toInt();
-        height = rx_wh.cap(2).toInt();
-        printType += rx_wh.cap(0);
+/*
+ * Turns the --fields paths into masks. "Object.loc" restricts the fields
+ * of Object wherever it is printed, "Object.id.name" also restricts the
+ * ID inside of Object to its name; a path that ends at a structure field
+ * selects it whole. Structures without a path are printed in full.
+ */
+void BlendToXml::compileFields()
+{
+    fieldMasks.clear();
+    structureMasks.clear();
+    if (fieldPaths.isEmpty()) {
         return;
     }
-    else {
-        QRegExp rx_w("\\[(\\d+)\\]");
-        if (rx_w.indexIn(name) > -1) {
-            width = rx_w.cap(1).toInt();
-            printType += rx_w.cap(0);
-            return;
+
+    for (int i = 0; i < file.structures().length(); i++) {
+        structureMasks.append(-1);
+    }
+
+    auto newMask = [this](uint32_t structure) {
+        FieldMask mask;
+        mask.fields = QBitArray(file.layouts().at(structure).fields.length());
+        for (int i = 0; i < mask.fields.size(); i++) {
+            mask.nested.append(-1);
+        }
+        fieldMasks.append(mask);
+        return fieldMasks.length() - 1;
+    };
+
+    for (const QString &path : fieldPaths) {
+        QStringList parts = path.split('.');
+        int type = file.typeNames().indexOf(parts[0]);
+        if (parts.length() < 2 || type < 0 || file.typeStructures()[type] == BlendFile::NOTYPE) {
+            blendError("Field path %s does not start with a structure name", qPrintable(path));
+        }
+
+        uint32_t structure = file.typeStructures()[type];
+        if (structureMasks[structure] < 0) {
+            structureMasks[structure] = newMask(structure);
+        }
+        int mask = structureMasks[structure];
+
+        for (int part = 1; part < parts.length(); part++) {
+            const QList<FieldLayout> &fields = file.layouts().at(structure).fields;
+            int i = 0;
+            while (i < fields.length() && fields[i].tag != parts[part].toUtf8()) {
+                i++;
+            }
+            if (i == fields.length()) {
+                blendError("Field path %s: %s has no field %s", qPrintable(path),
+                           file.typeName(structure).data(), qPrintable(parts[part]));
+            }
+
+            bool whole = fieldMasks[mask].fields.testBit(i) && fieldMasks[mask].nested[i] < 0;
+            fieldMasks[mask].fields.setBit(i);
+            if (part == parts.length() - 1) {
+                fieldMasks[mask].nested[i] = -1;
+                break;
+            }
+            if (fields[i].kind != FieldLayout::Struct) {
+                blendError("Field path %s: %s is not a structure", qPrintable(path), qPrintable(parts[part]));
+            }
+            if (whole) {
+                break;
+            }
+
+            structure = fields[i].structure;
+            if (fieldMasks[mask].nested[i] < 0) {
+                int nested = newMask(structure);
+                fieldMasks[mask].nested[i] = nested;
+            }
+            mask = fieldMasks[mask].nested[i];
         }
     }
 }
 
-BlendToXml::BlendToXml(QIODevice *in, QIODevice *out, bool notypes, bool nodata, bool printRawPointers, QObject *parent) :
-    QObject(parent), m_in(in), m_out(out),
-    notypes(notypes), nodata(nodata), printRawPointers(printRawPointers), ptrSize(0)
-{}
+int BlendToXml::structureMask(uint32_t structure) const
+{
+    return structureMasks.value(static_cast<int>(structure), -1);
+}
 
-void BlendToXml::run()
+// Mask of the structure in field i of a structure printed with mask
+int BlendToXml::nestedMask(int mask, int field, const FieldLayout &layout) const
 {
-    stream.setDevice(m_in);
-    stream.setByteOrder(QDataStream::LittleEndian);
+    if (mask >= 0 && fieldMasks.at(mask).nested.at(field) >= 0) {
+        return fieldMasks.at(mask).nested.at(field);
+    }
+    return structureMask(layout.structure);
+}
 
-    QXmlStreamWriter out(m_out);
-    out.setAutoFormatting(true);
-    out.writeStartDocument();
+bool BlendToXml::isFieldSelected(int mask, int field) const
+{
+    return mask < 0 || fieldMasks.at(mask).fields.testBit(field);
+}
 
-    out.writeStartElement("blend");
+enum CharMode { FlagMode, AsciiMode, MixedMode, DataMode };
 
-    {
-        auto identifier = readString<7>();
+/*
+ * A single char is a flag. Arrays are text if every row is printable
+ * Latin-1 up to its first non-printable character and only NULs follow;
+ * other arrays are escaped text if the field name suggests a string and
+ * hex data otherwise. Rows are scanned 16 bytes at a time, with the table
+ * consulted only for characters above ASCII.
+ */
+static CharMode charMode(const FieldLayout &field, const uchar *data)
+{
+    if (field.width * field.height == 1) {
+        return FlagMode;
+    }
 
-        if (identifier != "BLENDER") {
-            qFatal("This tool does not support compressed files.\n"
-                   "Rename .blend-file to .blend.gz and unpack before running this tool again\n");
+    const bool *printable = charTables().printable;
+    for (size_t i = 0; i < field.height; i++) {
+        const uchar *p = data + i * field.width;
+        const uchar *end = p + field.width;
+        for (;;) {
+            p = asciiPrintableEnd(p, end);
+            if (p == end || !printable[*p]) {
+                break;
+            }
+            p++;
         }
+        if (!isZero(p, end)) {
+            return field.isText ? MixedMode : DataMode;
+        }
+    }
+    return AsciiMode;
+}
+
+/*
+ * Decodes a whole array of numbers at once and formats it as one run,
+ * instead of dispatching on the field kind for every value.
+ */
+template<typename D, typename T, typename Bits = T>
+static void printNumbers(XmlWriter &out, const uchar *data, uint32_t count, bool binary)
+{
+    QVarLengthArray<T, 256> values(static_cast<int>(count));
+    D::template loadArray<Bits>(data, count, values.data());
+    out.writeNumbers(values.constData(), static_cast<int>(count), binary);
+}
+
+/*
+ * Binary output keeps numbers as raw little-endian runs, so a file with
+ * the same byte order is copied as is.
+ */
+template<typename D, typename Bits>
+static void packNumbers(PackWriter &out, const uchar *data, uint32_t count)
+{
+    char *dest = out.appendBinary(static_cast<int>(count * sizeof(Bits)));
+    D::template loadArray<Bits>(data, count, dest);
+    qToLittleEndian<Bits>(dest, count, dest);
+}
+
+/*
+ * Writes the "ref" attribute of a pointer field: for every pointer the
+ * index of the block it points into, followed by "[element]" for blocks
+ * of several structures and "+offset" for pointers into the middle of a
+ * structure. NULL pointers are written as "-" and pointers outside of
+ * all blocks as "?".
+ */
+template<typename D>
+void BlendToXml::printReference(XmlWriter &out, const uchar *data, uint32_t count)
+{
+    QVarLengthArray<char, 64> text;
+    bool any = false;
 
-        ptrSize = (readType<uint8_t>() == '_') ? 4 : 8;
-        auto endianness = readType<uint8_t>();
+    for (uint32_t i = 0; i < count; i++) {
+        char entry[64];
+        char *p = entry;
+        auto address = D::loadAddress(data + i * D::PointerSize);
+        AddressIndex::Target target;
 
-        if (endianness == 'V') {
-            stream.setByteOrder(QDataStream::BigEndian);
+        if (!address) {
+            *p++ = '-';
+        } else if (!addresses->find(address, target)) {
+            *p++ = '?';
+            any = true;
+        } else {
+            p = std::to_chars(p, entry + sizeof(entry), target.block).ptr;
+            if (target.array) {
+                *p++ = '[';
+                p = std::to_chars(p, entry + sizeof(entry), target.element).ptr;
+                *p++ = ']';
+            }
+            if (target.offset) {
+                *p++ = '+';
+                p = std::to_chars(p, entry + sizeof(entry), target.offset).ptr;
+            }
+            any = true;
         }
 
-        out.writeAttribute("identifier", identifier);
-        out.writeAttribute("pointer-size", QString::number(ptrSize));
-        out.writeAttribute("endianness", QString(endianness));
-        out.writeAttribute("version-number", readString<3>());
+        if (i) {
+            text.append(' ');
+        }
+        text.append(entry, static_cast<int>(p - entry));
     }
 
-    while (!stream.atEnd()) {
-        Block b;
-        b.name = readString<4>();
-        b.size = readType<uint32_t>();
-        b.oldMemoryAddress = readAddress();
-        b.sdnaIndex = readType<uint32_t>();
-        b.count = readType<uint32_t>();
-        b.pos = m_in->pos();
+    if (any) {
+        out.writeAttribute("ref", text.constData(), text.size());
+    }
+}
 
-        if (b.name == "DNA1") {
-            readAlignedIdent("SDNA");
+template<typename D>
+void BlendToXml::printStructure(XmlWriter &out, const uchar *data, uint32_t structure, int mask)
+{
+    const QList<FieldLayout> &fields = file.layouts().at(structure).fields;
+    for (int i = 0; i < fields.length(); i++) {
+        const FieldLayout &field = fields.at(i);
+        if (field.isPad || !isFieldSelected(mask, i)) {
+            continue;
+        }
 
-            readAlignedIdent("NAME");
-            auto namesCount = readType<uint32_t>();
-            for (size_t i = 0; i < namesCount; i++) {
-                names << readString();
-            }
+        out.writeStartElement(field.tag);
+        out.writeAttribute("type", field.printType);
+        printField<D>(out, data + field.offset, field, nestedMask(mask, i, field));
+        out.writeEndElement();
+    }
+}
 
-            readAlignedIdent("TYPE");
-            auto types = readType<uint32_t>();
-            for (size_t i = 0; i < types; i++) {
-                typenames << readString();
-            }
+/*
+ * Writes the value of a field. mask applies to the fields of nested
+ * structures.
+ */
+template<typename D>
+void BlendToXml::printField(XmlWriter &out, const uchar *data, const FieldLayout &field, int mask)
+{
+    const uint32_t count = field.width * field.height;
 
-            readAlignedIdent("TLEN");
-            for (size_t i = 0; i < types; i++) {
-                auto typelength = readType<uint16_t>();
-#if 0
-                if (typelength % 4) {
-                    qFatal(qPrintable(QString("Invalid structure length %1").arg(typelength)));
-                }
-                typelength /= 4;
-#endif
-                typelengths << typelength;
-            }
-
-            for (size_t i = 0; i < types; i++) {
-                typestructures.append(NOTYPE);
-            }
-
-            readAlignedIdent("STRC");
-            auto structuresCount = readType<uint32_t>();
-            for (uint32_t i = 0; i < structuresCount; i++) {
-                Structure s;
-                s.type = readType<uint16_t>();
-                Q_ASSERT(typestructures[s.type] == NOTYPE);
-                typestructures[s.type] = i;
-                auto fields = readType<uint16_t>();
-                for (size_t j = 0; j < fields; j++) {
-                    Field f;
-                    f.type = readType<uint16_t>();
-                    f.name = readType<uint16_t>();
-                    s.fields.append(f);
+    switch (field.kind) {
+    case FieldLayout::Pointer:
+        if (references) {
+            printReference<D>(out, data, count);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            auto address = D::loadAddress(data + i * D::PointerSize);
+            if (address) {
+                if (printRawPointers) {
+                    out.writeHex(address);
+                } else {
+                    out.writeSafeCharacters("0xDEADBEEF", 10);
                 }
-                structures.append(s);
+            } else {
+                out.writeSafeCharacters("NULL", 4);
             }
-            break;
-        } else {
-            skipBytes(b.size);
-            blocks.append(b);
         }
-    }
+        return;
 
-    if (!notypes) {
-        out.writeStartElement("types");
-        for (int i = 0; i < typenames.length(); i++) {
-            out.writeStartElement("type");
-            out.writeAttribute("name", typenames[i]);
-            out.writeAttribute("length", QString::number(typelengths[i]));
-            out.writeEndElement();
+    case FieldLayout::Struct:
+        for (uint32_t i = 0; i < count; i++) {
+            if (count != 1) {
+                out.writeStartElement(ElemTag);
+            }
+            printStructure<D>(out, data + i * file.layouts().at(field.structure).size, field.structure, mask);
+            if (count != 1) {
+                out.writeEndElement();
+            }
         }
-        out.writeEndElement();
+        return;
 
-        out.writeStartElement("structures");
-        for (const auto &structure : structures) {
-            out.writeStartElement("structure");
-            out.writeAttribute("type", typenames[structure.type]);
-            out.writeAttribute("size", QString::number(typelengths[structure.type]));
-            for (const auto &field : structure.fields) {
-                out.writeStartElement("field");
-                out.writeAttribute("type", typenames[field.type]);
-                out.writeAttribute("name", names[field.name]);
-                out.writeEndElement();
+    case FieldLayout::Char:
+        break;
+
+    case FieldLayout::Int8:
+        printNumbers<D, quint8>(out, data, count, field.isFlag);
+        return;
+    case FieldLayout::Int16:
+        printNumbers<D, quint16>(out, data, count, field.isFlag);
+        return;
+    case FieldLayout::Int32:
+        printNumbers<D, quint32>(out, data, count, field.isFlag);
+        return;
+    case FieldLayout::Int64:
+        printNumbers<D, quint64>(out, data, count, field.isFlag);
+        return;
+    case FieldLayout::Float:
+        printNumbers<D, float, quint32>(out, data, count, false);
+        return;
+    case FieldLayout::Double:
+        printNumbers<D, double, quint64>(out, data, count, false);
+        return;
+
+    default:
+        for (uint32_t i = 0; i < count; i++) {
+            out.writeSafeCharacters("???", 3);
+            if (i != count - 1) {
+                out.writeSafeCharacters(" ", 1);
             }
-            out.writeEndElement();
         }
-        out.writeEndElement();
+        return;
     }
 
-    if (!nodata) {
-        for (const Block &block : blocks) {
-            m_in->seek(block.pos);
-            out.writeStartElement(typenames[structures[block.sdnaIndex].type]);
-            out.writeAttribute("block", block.name);
+    CharMode mode = charMode(field, data);
+    if (mode == FlagMode) {
+        out.writeAttribute("mode", "flag");
+        out.writeBinary(data[0]);
+        return;
+    }
 
-            if (printRawPointers) {
-                out.writeAttribute("old-memory-address", QString::number(block.oldMemoryAddress, 16));
+    auto bytes = reinterpret_cast<const char *>(data);
+
+    if (mode == AsciiMode) {
+        out.writeAttribute("mode", "ascii");
+        for (size_t i = 0; i < field.height; i++) {
+            const char *row = bytes + i * field.width;
+            int len = static_cast<int>(qstrnlen(row, count - i * field.width));
+            if (isAscii(row, len)) {
+                out.writeCharacters(row, len);
+            } else {
+                // Invalid UTF-8 is replaced the same way as before
+                out.writeCharacters(QString::fromUtf8(row, len));
+            }
+        }
+    } else if (mode == MixedMode) {
+        out.writeAttribute("mode", "mixed");
+        const CharTables::Escape *escapes = charTables().escapes;
+        for (size_t i = 0; i < field.height; i++) {
+            const uchar *row = data + i * field.width;
+            size_t nonNullCharacters = field.width;
+            while (nonNullCharacters && !row[nonNullCharacters - 1]) {
+                nonNullCharacters--;
+            }
+            if (!nonNullCharacters) {
+                continue;
             }
 
-            for (size_t i = 0; i < block.count; i++) {
-                if (block.count != 1) {
-                    out.writeStartElement("elem");
-                }
-                printStructure(out, structures[block.sdnaIndex].type, CombType());
-                if (block.count != 1) {
-                    out.writeEndElement();
+            // Escapes are copied whole, so the last one may write past its
+            // length into the slack
+            const int maxLength = static_cast<int>(nonNullCharacters) * 6 + sizeof(escapes->text);
+            out.fillSafeCharacters(maxLength, [&](char *p) {
+                for (size_t j = 0; j < nonNullCharacters; j++) {
+                    const CharTables::Escape &escape = escapes[row[j]];
+                    memcpy(p, escape.text, sizeof(escape.text));
+                    p += escape.length;
                 }
+                return p;
+            });
+        }
+    } else {
+        out.writeAttribute("mode", "data");
+        const char (*hex)[2] = charTables().hex;
+        out.fillSafeCharacters(static_cast<int>(count) * 2, [&](char *p) {
+            for (uint32_t i = 0; i < count; i++) {
+                memcpy(p, hex[data[i]], 2);
+                p += 2;
             }
-            out.writeEndElement();
+            return p;
+        });
+    }
+}
+
+template<typename D>
+void BlendToXml::printStructure(PackWriter &out, const uchar *data, uint32_t structure, int mask)
+{
+    // Pad fields and fields left out by --fields keep their place as nil
+    const QList<FieldLayout> &fields = file.layouts().at(structure).fields;
+    out.writeArray(fields.length());
+    for (int i = 0; i < fields.length(); i++) {
+        const FieldLayout &field = fields.at(i);
+        if (field.isPad || !isFieldSelected(mask, i)) {
+            out.writeNil();
+        } else {
+            printField<D>(out, data + field.offset, field, nestedMask(mask, i, field));
         }
     }
+}
 
-    out.writeEndElement();
-    out.writeEndDocument();
+/*
+ * Arrays of pointers and structures become MessagePack arrays, single
+ * ones are written directly. Numbers are a bin object even when there is
+ * only one of them, and chars are a [mode, bin] pair with the mode
+ * numbered flag = 0, ascii = 1, mixed = 2 and data = 3.
+ */
+template<typename D>
+void BlendToXml::printField(PackWriter &out, const uchar *data, const FieldLayout &field, int mask)
+{
+    const uint32_t count = field.width * field.height;
 
-    emit finished();
-}
+    switch (field.kind) {
+    case FieldLayout::Pointer:
+        if (count == 1) {
+            printPointer<D>(out, data);
+            return;
+        }
+        out.writeArray(count);
+        for (uint32_t i = 0; i < count; i++) {
+            printPointer<D>(out, data + i * D::PointerSize);
+        }
+        return;
+
+    case FieldLayout::Struct:
+        if (count == 1) {
+            printStructure<D>(out, data, field.structure, mask);
+            return;
+        }
+        out.writeArray(count);
+        for (uint32_t i = 0; i < count; i++) {
+            printStructure<D>(out, data + i * file.layouts().at(field.structure).size, field.structure, mask);
+        }
+        return;
 
+    case FieldLayout::Char:
+        out.writeArray(2);
+        out.writeUInt(charMode(field, data));
+        out.writeBinary(reinterpret_cast<const char *>(data), static_cast<int>(count));
+        return;
 
-QString BlendToXml::readString(std::size_t len)
-{
-    std::unique_ptr<char[]> data(new char[len + 1]);
-    stream.readRawData(data.get(), static_cast<int>(len));
-    data[len] = '\0';
-    return QString(data.get());
+    case FieldLayout::Int8:
+        packNumbers<D, quint8>(out, data, count);
+        return;
+    case FieldLayout::Int16:
+        packNumbers<D, quint16>(out, data, count);
+        return;
+    case FieldLayout::Int32:
+    case FieldLayout::Float:
+        packNumbers<D, quint32>(out, data, count);
+        return;
+    case FieldLayout::Int64:
+    case FieldLayout::Double:
+        packNumbers<D, quint64>(out, data, count);
+        return;
+
+    default:
+        out.writeNil();
+        return;
+    }
 }
 
-QString BlendToXml::readString()
+/*
+ * NULL is nil and other pointers are 0xDEADBEEF or, with --rawpointers,
+ * the address. With --references a resolved pointer becomes an array
+ * [address, block, element, offset].
+ */
+template<typename D>
+void BlendToXml::printPointer(PackWriter &out, const uchar *data)
 {
-    QString str;
-    char c;
-    while ((c = readType<uint8_t>())) {
-        str.append(QChar(c));
+    auto address = D::loadAddress(data);
+    if (!address) {
+        out.writeNil();
+        return;
     }
-    return str;
+
+    uint64_t value = printRawPointers ? address : 0xDEADBEEF;
+    AddressIndex::Target target;
+    if (references && addresses->find(address, target)) {
+        out.writeArray(4);
+        out.writeUInt(value);
+        out.writeUInt(target.block);
+        out.writeUInt(target.element);
+        out.writeUInt(target.offset);
+        return;
+    }
+    out.writeUInt(value);
 }
 
-uint64_t BlendToXml::readAddress()
+// Datablocks are matched by ID name, other blocks by code and address
+static QString diffKey(const BlendFile &file, const Block &block)
 {
-    if (ptrSize == 4) {
-        return readType<quint32>();
-    } else {
-        return readType<quint64>();
+    if (!file.idName(block).isEmpty()) {
+        return file.idName(block);
     }
+    return QString(block.name()) + QLatin1Char('@') + QString::number(block.oldMemoryAddress, 16);
 }
 
-void BlendToXml::skipBytes(std::size_t len)
+static uint64_t blockHash(const BlendFile &file, const Block &block)
 {
-    stream.skipRawData(static_cast<int>(len));
+    QByteArray data = file.blockData(block);
+    return xxHash64(data.constData(), static_cast<size_t>(data.size()));
 }
 
-QByteArray BlendToXml::readBytes(std::size_t len)
+/*
+ * Blocks are paired by diffKey() first. Blender keeps addresses only
+ * within a session, so the selected blocks left over are paired by the
+ * XXH64 hash of their bytes, which finds data that moved without
+ * changing; a hash alone never pairs a block. Paired blocks with equal
+ * bytes are skipped without looking at their fields.
+ */
+template<typename D>
+void BlendToXml::diff(XmlWriter &out, BlendFile &old)
 {
-    std::unique_ptr<char[]> data(new char[len]);
-    stream.readRawData(data.get(), static_cast<int>(len));
-    return QByteArray(data.get(), static_cast<int>(len));
+    file.load();
+    old.load();
+    phaseTimes.scan = file.scanTime() + old.scanTime();
+    phaseTimes.dna = file.dnaTime() + old.dnaTime();
+    compileFields();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    file.readIdNames();
+    old.readIdNames();
+    blocks = file.blocks();
+
+    QList<int> oldMatch;
+    QHash<QString, QList<int>> oldKeys;
+    for (int i = 0; i < old.blocks().length(); i++) {
+        oldMatch.append(-1);
+        oldKeys[diffKey(old, old.blocks().at(i))].append(i);
+    }
+
+    QList<int> match;
+    for (int i = 0; i < blocks.length(); i++) {
+        match.append(-1);
+        QList<int> &candidates = oldKeys[diffKey(file, blocks.at(i))];
+        if (!candidates.isEmpty()) {
+            match[i] = candidates.takeFirst();
+            oldMatch[match[i]] = i;
+        }
+    }
+
+    QHash<uint64_t, QList<int>> oldContents;
+    for (int i = 0; i < old.blocks().length(); i++) {
+        const Block &oldBlock = old.blocks().at(i);
+        if (oldMatch[i] < 0 && (selection.isEmpty() || isSelected(old, oldBlock))) {
+            oldContents[blockHash(old, oldBlock)].append(i);
+        }
+    }
+    for (int i = 0; i < blocks.length() && !oldContents.isEmpty(); i++) {
+        const Block &block = blocks.at(i);
+        if (match[i] >= 0 || (!selection.isEmpty() && !isSelected(file, block))) {
+            continue;
+        }
+        QByteArray data = file.blockData(block);
+        auto found = oldContents.find(xxHash64(data.constData(), static_cast<size_t>(data.size())));
+        if (found == oldContents.end()) {
+            continue;
+        }
+        QList<int> &candidates = found.value();
+        for (int j = 0; j < candidates.length(); j++) {
+            const Block &oldBlock = old.blocks().at(candidates[j]);
+            if (oldBlock.name() == block.name() && oldBlock.size == block.size && sameLayout(old, oldBlock.sdnaIndex, block.sdnaIndex) &&
+                    old.blockData(oldBlock) == data) {
+                match[i] = candidates.takeAt(j);
+                oldMatch[match[i]] = i;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < blocks.length(); i++) {
+        const Block &block = blocks.at(i);
+        if (!selection.isEmpty() && !isSelected(file, block)) {
+            continue;
+        }
+
+        QByteArray data = file.read(block.pos, block.size);
+        if (match[i] >= 0) {
+            const Block &oldBlock = old.blocks().at(match[i]);
+            QByteArray oldData = old.blockData(oldBlock);
+            if (oldData == data) {
+                continue;
+            }
+            if (sameLayout(old, oldBlock.sdnaIndex, block.sdnaIndex)) {
+                printBlockDiff<D>(out, oldBlock, oldData, block, data);
+                continue;
+            }
+        }
+
+        // New blocks and blocks whose structure changed are written in full
+        startDiffBlock(out, file, block, match[i] >= 0 ? "replaced" : "added");
+        const uint32_t size = file.layouts().at(block.sdnaIndex).size;
+        auto bytes = reinterpret_cast<const uchar *>(data.constData());
+        for (uint32_t j = 0; j < file.elementCount(block); j++) {
+            if (block.count != 1) {
+                out.writeStartElement(ElemTag);
+            }
+            printStructure<D>(out, bytes + j * size, block.sdnaIndex, structureMask(block.sdnaIndex));
+            if (block.count != 1) {
+                out.writeEndElement();
+            }
+        }
+        out.writeEndElement();
+    }
+
+    for (int i = 0; i < old.blocks().length(); i++) {
+        const Block &oldBlock = old.blocks().at(i);
+        if (oldMatch[i] >= 0 || (!selection.isEmpty() && !isSelected(old, oldBlock))) {
+            continue;
+        }
+        startDiffBlock(out, old, oldBlock, "removed");
+        out.writeEndElement();
+    }
+    phaseTimes.data = timer.nsecsElapsed();
 }
 
-quint16 BlendToXml::readBytesCrc(std::size_t len)
+/*
+ * Structures can be compared field by field if they have the same name
+ * and the same fields at the same offsets, down to nested structures.
+ */
+bool BlendToXml::sameLayout(const BlendFile &old, uint32_t oldStructure, uint32_t structure) const
 {
-    std::unique_ptr<char[]> data(new char[len]);
-    stream.readRawData(data.get(), static_cast<int>(len));
-    return qChecksum(data.get(), static_cast<int>(len));
+    const StructLayout &oldLayout = old.layouts().at(oldStructure);
+    const StructLayout &layout = file.layouts().at(structure);
+
+    if (old.typeName(oldStructure) != file.typeName(structure) ||
+            oldLayout.size != layout.size || oldLayout.fields.length() != layout.fields.length()) {
+        return false;
+    }
+
+    for (int i = 0; i < layout.fields.length(); i++) {
+        const FieldLayout &oldField = oldLayout.fields.at(i);
+        const FieldLayout &field = layout.fields.at(i);
+        if (oldField.kind != field.kind || oldField.offset != field.offset || oldField.size != field.size ||
+                oldField.tag != field.tag || oldField.printType != field.printType) {
+            return false;
+        }
+        if (field.kind == FieldLayout::Struct && !sameLayout(old, oldField.structure, field.structure)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void BlendToXml::readAlignedIdent(const char *ident)
+void BlendToXml::startDiffBlock(XmlWriter &out, const BlendFile &source, const Block &block, const char *change)
 {
-    for (int i = 0; i < 4; i++) {
-        char c = readType<uint8_t>();
-        if (c) {
-            Q_ASSERT(QChar(c) + readString<3>() == ident);
-            return;
-        }
+    out.writeStartElement(source.layouts().at(block.sdnaIndex).tag);
+    out.writeAttribute("block", block.name());
+    if (!source.idName(block).isEmpty()) {
+        out.writeAttribute("id", source.idName(block));
+    } else {
+        out.writeAttribute("old-memory-address", block.oldMemoryAddress, 16);
     }
-    Q_ASSERT(!"Unable to find aligned word");
+    out.writeAttribute("change", change);
 }
 
-void BlendToXml::printStructure(QXmlStreamWriter &out, int typeId, const CombType &type)
+/*
+ * A field differs if its output would differ: without --rawpointers all
+ * addresses are written as 0xDEADBEEF, so only NULL pointers count.
+ */
+template<typename D>
+bool BlendToXml::fieldDiffers(const uchar *oldData, const uchar *data, const FieldLayout &field, int mask) const
 {
-    if (type.isPointer) {
-        for (size_t i = 0; i < type.height; i++) {
-            for (size_t j = 0; j < type.width; j++) {
-                auto address = readAddress();
-                if (address) {
-                    if (printRawPointers) {
-                        out.writeCharacters(QString::number(address, 16));
-                    } else {
-                        out.writeCharacters("0xDEADBEEF");
-                    }
-                } else {
-                    out.writeCharacters("NULL");
-                }
+    const uint32_t count = field.width * field.height;
+
+    switch (field.kind) {
+    case FieldLayout::Pointer:
+        if (printRawPointers) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (!D::loadAddress(oldData + i * D::PointerSize) != !D::loadAddress(data + i * D::PointerSize)) {
+                return true;
             }
         }
-        return;
-    }
+        return false;
 
-    if (typestructures[typeId] == NOTYPE) {
-        bool isSingle = type.height == 1 && type.width == 1;
-        bool isFlag = isSingle && (type.shortname.contains("flag") || type.shortname.contains("type"));
-
-        if (typenames[typeId] == "char") {
-            if (isSingle) {
-                out.writeAttribute("mode", "flag");
-                out.writeCharacters(QString("0b%1").arg(readType<quint8>(), 0, 2));
-                return;
-            }
-
-            QByteArray bytes = readBytes(type.height * type.width);
-
-            bool fullprint = true;
-            for (size_t i = 0; i < type.height; i++) {
-                for (size_t j = 0; j < type.width; j++) {
-                    uint8_t c = bytes.at(static_cast<int>(i * type.width + j));
-                    QChar qc(c);
-                    if (qc.toLatin1() != c || !qc.isPrint()) {
-                        for (; j < type.width; j++) {
-                            uint8_t nullc = bytes.at(static_cast<int>(i * type.width + j));
-                            if (nullc != '\0') {
-                                fullprint = false;
-                                break;
-                            }
-                        }
-                    }
-                }
-                if (!fullprint) {
-                    break;
-                }
-            }
-            if (fullprint) {
-                out.writeAttribute("mode", "ascii");
-                for (size_t i = 0; i < type.height; i++) {
-                    out.writeCharacters(QString(bytes.data() + i * type.width));
-                }
-            } else if (type.shortname.contains("name") ||
-                       type.shortname.contains("title") ||
-                       type.shortname.contains("filepath") ||
-                       type.shortname.contains("string") ||
-                       type.shortname == "dir" ||
-                       type.shortname == "file" ||
-                       type.shortname.endsWith("str")) {
-                out.writeAttribute("mode", "mixed");
-                for (size_t i = 0; i < type.height; i++) {
-
-                    size_t nonNullCharacters = type.width;
-                    while (nonNullCharacters) {
-                        if (bytes.at(static_cast<int>(i * type.width + nonNullCharacters - 1))) {
-                            break;
-                        }
-                        nonNullCharacters--;
-                    }
-
-                    for (size_t j = 0; j < nonNullCharacters; j++) {
-                        char byte = bytes.at(static_cast<int>(i * type.width + j));
-                        auto ascii = QChar::fromLatin1(byte);
-                        if (byte == '\0') {
-                            out.writeCharacters("\\0");
-                        } else if (byte == '\\') {
-                            out.writeCharacters("\\\\");
-                        } else if (ascii.unicode() <= 127 && ascii.isPrint()) {
-                            out.writeCharacters(ascii);
-                        } else {
-                            out.writeCharacters(QString("\\%1").arg((quint8)byte, 3, 8, QLatin1Char('0')));
-                        }
-                    }
-                }
-            } else {
-                out.writeAttribute("mode", "data");
-                for (size_t i = 0; i < type.height; i++) {
-                    for (size_t j = 0; j < type.width; j++) {
-                        char byte = bytes.at(static_cast<int>(i * type.width + j));
-                        out.writeCharacters(QString("%1").arg((quint8)byte, 2, 16, QLatin1Char('0')));
-                    }
-                }
+    case FieldLayout::Struct:
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t offset = i * file.layouts().at(field.structure).size;
+            if (structureDiffers<D>(oldData + offset, data + offset, field.structure, mask)) {
+                return true;
             }
-            return;
         }
+        return false;
 
-        for (size_t i = 0; i < type.height; i++) {
-            for (size_t j = 0; j < type.width; j++) {
-                switch (typelengths[typeId]) {
-                case 0:
-                    out.writeCharacters("???");
-                    break;
-                case 1:
-                    if (isFlag)
-                        out.writeCharacters(QString("0b%1").arg(readType<quint8>(), 0, 2));
-                    else
-                        out.writeCharacters(QString::number(readType<quint8>()));
-                    break;
-                case 2:
-                    if (isFlag)
-                        out.writeCharacters(QString("0b%1").arg(readType<quint16>(), 0, 2));
-                    else
-                        out.writeCharacters(QString::number(readType<quint16>()));
-                    break;
-                case 4:
-                    if (typenames[typeId] == "float") {
-                        out.writeCharacters(QString::number(readType<float>()));
-                    } else {
-                        if (isFlag)
-                            out.writeCharacters(QString("0b%1").arg(readType<quint32>(), 0, 2));
-                        else
-                            out.writeCharacters(QString::number(readType<quint32>()));
-                    }
-                    break;
-                case 8:
-                    if (typenames[typeId] == "double") {
-                        out.writeCharacters(QString::number(readType<double>()));
-                    } else {
-                        if (isFlag)
-                            out.writeCharacters(QString("0b%1").arg(readType<quint64>(), 0, 2));
-                        else
-                            out.writeCharacters(QString::number(readType<quint64>()));
-                    }
-                    break;
-                default: Q_ASSERT(!"Too long typelength");
-                }
-                if (i != type.height - 1 || j != type.width - 1) {
-                    out.writeCharacters(" ");
-                }
-            }
+    default:
+        break;
+    }
+    return memcmp(oldData, data, field.size) != 0;
+}
+
+template<typename D>
+bool BlendToXml::structureDiffers(const uchar *oldData, const uchar *data, uint32_t structure, int mask) const
+{
+    const QList<FieldLayout> &fields = file.layouts().at(structure).fields;
+    for (int i = 0; i < fields.length(); i++) {
+        const FieldLayout &field = fields.at(i);
+        if (!field.isPad && isFieldSelected(mask, i) &&
+                fieldDiffers<D>(oldData + field.offset, data + field.offset, field, nestedMask(mask, i, field))) {
+            return true;
         }
+    }
+    return false;
+}
+
+/*
+ * Writes a block whose structure is unchanged with only the fields that
+ * differ. Elements of arrays are marked with their index, and elements
+ * beyond the end of the other block as added or removed.
+ */
+template<typename D>
+void BlendToXml::printBlockDiff(XmlWriter &out, const Block &oldBlock, const QByteArray &oldData, const Block &block, const QByteArray &data)
+{
+    const uint32_t size = file.layouts().at(block.sdnaIndex).size;
+    const uint32_t oldCount = size ? qMin(oldBlock.count, oldBlock.size / size) : oldBlock.count;
+    const uint32_t count = file.elementCount(block);
+    const uint32_t common = qMin(oldCount, count);
+    const int mask = structureMask(block.sdnaIndex);
+    auto oldBytes = reinterpret_cast<const uchar *>(oldData.constData());
+    auto bytes = reinterpret_cast<const uchar *>(data.constData());
+
+    bool changed = oldCount != count;
+    for (uint32_t i = 0; i < common && !changed; i++) {
+        changed = structureDiffers<D>(oldBytes + i * size, bytes + i * size, block.sdnaIndex, mask);
+    }
+    if (!changed) {
         return;
     }
 
-    for (size_t i = 0; i < type.height; i++) {
-        for (size_t j = 0; j < type.width; j++) {
-            if (type.width != 1 || type.height != 1) {
-                out.writeStartElement("elem");
-            }
-            for (const Field &field : structures[typestructures[typeId]].fields) {
-                CombType ct(names[field.name]);
+    startDiffBlock(out, file, block, "modified");
+    if (oldBlock.count == 1 && block.count == 1) {
+        printStructureDiff<D>(out, oldBytes, bytes, block.sdnaIndex, mask);
+        out.writeEndElement();
+        return;
+    }
+
+    for (uint32_t i = 0; i < qMax(oldCount, count); i++) {
+        if (i < common && !structureDiffers<D>(oldBytes + i * size, bytes + i * size, block.sdnaIndex, mask)) {
+            continue;
+        }
+        out.writeStartElement(ElemTag);
+        out.writeAttribute("index", QByteArray::number(i));
+        if (i >= oldCount) {
+            out.writeAttribute("change", "added");
+            printStructure<D>(out, bytes + i * size, block.sdnaIndex, mask);
+        } else if (i >= count) {
+            out.writeAttribute("change", "removed");
+        } else {
+            printStructureDiff<D>(out, oldBytes + i * size, bytes + i * size, block.sdnaIndex, mask);
+        }
+        out.writeEndElement();
+    }
+    out.writeEndElement();
+}
 
-                if (ct.shortname.contains(QRegularExpression("^_*pad\\d*$")))
-                    continue;
+// Changed leaf fields have an <old> and a <new> child with the two values
+template<typename D>
+void BlendToXml::printStructureDiff(XmlWriter &out, const uchar *oldData, const uchar *data, uint32_t structure, int mask)
+{
+    const QList<FieldLayout> &fields = file.layouts().at(structure).fields;
+    for (int f = 0; f < fields.length(); f++) {
+        const FieldLayout &field = fields.at(f);
+        const int fieldMask = nestedMask(mask, f, field);
+        if (field.isPad || !isFieldSelected(mask, f) ||
+                !fieldDiffers<D>(oldData + field.offset, data + field.offset, field, fieldMask)) {
+            continue;
+        }
 
-                out.writeStartElement(ct.shortname);
-                out.writeAttribute("type", typenames[field.type] + ct.printType);
-                printStructure(out, field.type, ct);
-                out.writeEndElement();
-            }
-            if (type.width != 1 || type.height != 1) {
-                out.writeEndElement();
+        out.writeStartElement(field.tag);
+        out.writeAttribute("type", field.printType);
+        if (field.kind == FieldLayout::Struct) {
+            const uint32_t size = file.layouts().at(field.structure).size;
+            const uint32_t count = field.width * field.height;
+            for (uint32_t i = 0; i < count; i++) {
+                const uchar *oldElement = oldData + field.offset + i * size;
+                const uchar *element = data + field.offset + i * size;
+                if (count == 1) {
+                    printStructureDiff<D>(out, oldElement, element, field.structure, fieldMask);
+                } else if (structureDiffers<D>(oldElement, element, field.structure, fieldMask)) {
+                    out.writeStartElement(ElemTag);
+                    out.writeAttribute("index", QByteArray::number(i));
+                    printStructureDiff<D>(out, oldElement, element, field.structure, fieldMask);
+                    out.writeEndElement();
+                }
             }
+        } else {
+            out.writeStartElement("old");
+            printField<D>(out, oldData + field.offset, field, fieldMask);
+            out.writeEndElement();
+            out.writeStartElement("new");
+            printField<D>(out, data + field.offset, field, fieldMask);
+            out.writeEndElement();
         }
+        out.writeEndElement();
     }
 }
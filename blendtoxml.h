@@ -20,115 +20,275 @@
 #ifndef BLENDTOXML_H
 #define BLENDTOXML_H
 
+#include <memory>
 #include <inttypes.h>
 
+#include <QBitArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
 #include <QString>
-#include <QDataStream>
 #include <QStringList>
 
+#include "blendfile.h"
+
 class QIODevice;
-class QXmlStreamWriter;
+class XmlWriter;
+class PackWriter;
+class AddressIndex;
+class ReadAhead;
+class SharedDnaCache;
 
-struct Block
+// Fields of a structure that are printed, compiled from --fields paths
+struct FieldMask
 {
-    QString name;
-    uint32_t size;
-    uint64_t oldMemoryAddress;
-    uint32_t sdnaIndex;
-    uint32_t count;
-    qint64 pos;
+    QBitArray fields;
+    QList<int> nested;  // mask of each nested structure, -1 for the mask of its type
 };
 
-struct Field
+// Wall clock time of the conversion phases, in nanoseconds
+struct PhaseTimings
 {
-    uint16_t type;
-    uint16_t name;
+    qint64 scan;    // block headers up to DNA1
+    qint64 dna;     // DNA1 parsing and layouts
+    qint64 types;   // <types> and <structures>
+    qint64 data;    // selection, reference lookup and block contents
 };
 
-struct Structure
+// Blocks of one structure type written by a conversion
+struct TypeStats
 {
-    uint16_t type;
-    QList<Field> fields;
+    QByteArray type;
+    quint64 blocks;
+    quint64 bytes;
+    qint64 time;    // formatting, summed over all threads, in nanoseconds
 };
 
-struct CombType
+// Totals of a conversion, collected when statistics are enabled
+struct ConversionStats
 {
-    bool isPointer;
-    size_t width, height;
-    QString shortname;
-    QString printType;
-
-    CombType() : isPointer(false), width(1), height(1) {}
-    CombType(const QString &name);
+    quint64 blocks;         // blocks written
+    quint64 bytes;          // block data read for them
+    QList<TypeStats> types; // types with at least one block written
 };
 
 class BlendToXml : public QObject
 {
     Q_OBJECT
 public:
+    enum Format { Xml, MessagePack };
+    // Blocks that repeat an earlier one: not detected, with the same bytes,
+    // or with the same bytes apart from the values of non-NULL pointers
+    enum Deduplication { NoDeduplication, SameBytes, SameValues };
+
     explicit BlendToXml(QIODevice *in, QIODevice *out, bool notypes, bool nodata, bool printRawPointers, QObject *parent = 0);
-    
+    ~BlendToXml();
+
+    void setJobs(int jobs);
+    void setStreaming(bool streaming);
+    void setIndexPath(const QString &path);
+    void setCachePath(const QString &directory);
+    void setSharedCache(SharedDnaCache *cache);
+    void setBuildIndex(bool buildIndex);
+    void setSelection(const QStringList &selection);
+    void setReferences(bool references);
+    void setFormat(Format format);
+    void setFields(const QStringList &paths);
+
+    // Converts a file that was loaded before instead of reading in. The
+    // copy shares the tables and the input of loaded, which must stay open.
+    void setFile(const BlendFile &loaded);
+
+    // Bytes of block data read ahead of formatting on a reader thread when
+    // the source is not memory mapped, 0 to read each block when needed
+    void setReadAhead(qint64 bytes);
+
+    // Writes blocks that repeat an earlier one as a reference to it
+    void setDeduplication(Deduplication deduplication);
+
+    // Counts blocks, bytes and time per structure type and emits progress()
+    void setStatistics(bool statistics);
+
+    // Writes only what changed relative to the file read from base
+    void setDiffBase(QIODevice *base);
+
+    // Writes the blocks, elements and bytes per block code and structure
+    // type, from the block headers alone
+    void setSummary(bool summary);
+
+    // Writes the header of every selected block, without its contents
+    void setHeadersOnly(bool headersOnly);
+
+    const PhaseTimings &timings() const;
+    const ConversionStats &statistics() const;
+
+    // Message of the error that stopped the last run, empty on success
+    QString errorString() const;
+
 public slots:
     void run();
 
 signals:
     void finished();
+    // Emitted about once a second while block contents are written
+    void progress(qint64 bytes, qint64 total);
 
 private:
-    const uint32_t NOTYPE = 0xFFFFFFFF;
-
     QIODevice *m_in;
     QIODevice *m_out;
     bool notypes;
     bool nodata;
     bool printRawPointers;
+    int jobs;
+    bool streaming;
+    QString indexPath;
+    QString cachePath;
+    bool buildIndex;
+    QStringList selection;
+    QList<uint32_t> selectedIndexes;    // from "#index" patterns
+    bool references;
+    Format format;
+    QStringList fieldPaths;
+    qint64 readAhead;
+    Deduplication deduplication;
+    QVector<QVector<uint32_t>> pointerOffsets;  // of every structure, for SameValues
+    QByteArray maskedValues;                    // scratch buffers of SameValues
+    QByteArray maskedFirst;
+    SharedDnaCache *sharedCache;
+    QIODevice *diffBase;
+    bool summary;
+    bool headersOnly;
+    PhaseTimings phaseTimes;
+    bool collectStats;
+    ConversionStats stats;
+    QVector<TypeStats> typeStats;   // by structure
+    QElapsedTimer progressTimer;
+    qint64 nextProgress;
+    qint64 totalBytes;
+    QString errorMessage;
 
-    QDataStream stream;
-    uint8_t ptrSize;
-
-    QList<Block> blocks;
-    QStringList names;
-    QStringList typenames;
-    QList<uint16_t> typelengths;
-    QList<uint32_t> typestructures;
-    QList<Structure> structures;
+    struct BlockChunk
+    {
+        int block;
+        uint32_t first, last;
+        bool done;
+        uint32_t sameAs;    // index of the block this one repeats
+        qint64 time;
+        QByteArray data;
+        QByteArray text;
+    };
 
-    QString readString(std::size_t len);
+    // The first block with some contents, for --dedup
+    struct FirstBlock
+    {
+        uint32_t index;
+        uint32_t structure;
+        uint32_t count;
+        QByteArray data;
+    };
+    QHash<quint64, FirstBlock> firstBlocks;     // by content hash
 
-    template<std::size_t N>
-    inline QString readString()
+    // Blocks of one code and structure type, for the summary
+    struct SummaryEntry
     {
-        char data[N + 1];
-        stream.readRawData(data, N);
-        data[N] = '\0';
-        return QString(data);
-    }
+        char code[4];
+        uint32_t structure;
+        quint64 blocks;
+        quint64 elements;
+        quint64 bytes;
+        uint32_t largest;
+    };
 
-    QString readString();
+    BlendFile file;
+    std::unique_ptr<AddressIndex> addresses;
 
-    template<typename T>
-    inline T readType()
-    {
-        T value;
-        stream >> value;
-        return value;
-    }
+    QVector<Block> blocks;      // the blocks to print
+    QList<FieldMask> fieldMasks;
+    QList<int> structureMasks;  // mask of every structure type, -1 to print all fields
 
-    uint64_t readAddress();
-    void skipBytes(std::size_t len);
+    void convertDocument();
+    void writeDocument(XmlWriter &out, const QByteArray &header);
+    void writeDocument(PackWriter &out, const QByteArray &header);
 
-    template<std::size_t N>
-    inline QByteArray readBytes()
-    {
-        char data[N];
-        stream.readRawData(data, N);
-        return QByteArray(data, N);
-    }
-
-    QByteArray readBytes(std::size_t len);
-    quint16 readBytesCrc(std::size_t len);
-    void readAlignedIdent(const char *ident);
-    void printStructure(QXmlStreamWriter &out, int typeId, const CombType &type);
+    void writeDiffDocument(XmlWriter &out, const QByteArray &header);
+    void configureFile(BlendFile &file) const;
+
+    void writeSummaryDocument(XmlWriter &out, const QByteArray &header);
+    void writeSummaryDocument(PackWriter &out, const QByteArray &header);
+    QList<SummaryEntry> summarize();
+
+    template<typename D, typename W>
+    void convert(W &out);
+
+    template<typename D>
+    void diff(XmlWriter &out, BlendFile &old);
+
+    bool sameLayout(const BlendFile &old, uint32_t oldStructure, uint32_t structure) const;
+    void startDiffBlock(XmlWriter &out, const BlendFile &source, const Block &block, const char *change);
+
+    template<typename D>
+    bool fieldDiffers(const uchar *oldData, const uchar *data, const FieldLayout &field, int mask) const;
+    template<typename D>
+    bool structureDiffers(const uchar *oldData, const uchar *data, uint32_t structure, int mask) const;
+
+    template<typename D>
+    void printBlockDiff(XmlWriter &out, const Block &oldBlock, const QByteArray &oldData, const Block &block, const QByteArray &data);
+    template<typename D>
+    void printStructureDiff(XmlWriter &out, const uchar *oldData, const uchar *data, uint32_t structure, int mask);
+
+    bool isSelected(const BlendFile &source, const Block &block) const;
+
+    void startDeduplication();
+    void collectPointers(uint32_t structure, uint32_t base, QVector<uint32_t> &offsets) const;
+    uint32_t duplicateOf(const Block &block, const QByteArray &data);
+    const QByteArray &maskPointers(const Block &block, const QByteArray &data, QByteArray &values) const;
+    void printDuplicate(XmlWriter &out, const Block &block, uint32_t sameAs);
+    void printDuplicate(PackWriter &out, const Block &block, uint32_t sameAs);
+
+    void startStats();
+    void countBlock(const Block &block, qint64 time, bool firstChunk);
+    void finishStats();
+
+    void compileFields();
+    int structureMask(uint32_t structure) const;
+    int nestedMask(int mask, int field, const FieldLayout &layout) const;
+    bool isFieldSelected(int mask, int field) const;
+
+    void printTypes(XmlWriter &out);
+    void printTypes(PackWriter &out);
+
+    void printHeader(XmlWriter &out, const Block &block);
+    void printHeader(PackWriter &out, const Block &block);
+
+    template<typename D>
+    void printBlock(XmlWriter &out, const Block &block, const QByteArray &data, uint32_t first, uint32_t last);
+    template<typename D>
+    void printBlock(PackWriter &out, const Block &block, const QByteArray &data, uint32_t first, uint32_t last);
+
+    template<typename D, typename W>
+    void printBlocksParallel(W &out, ReadAhead &reader);
+
+    template<typename D, typename W>
+    void formatChunk(const BlockChunk &chunk, QByteArray &text);
+
+    void enterChunk(XmlWriter &out, const BlockChunk &chunk);
+    void enterChunk(PackWriter &out, const BlockChunk &chunk);
+
+    template<typename D>
+    void printStructure(XmlWriter &out, const uchar *data, uint32_t structure, int mask);
+    template<typename D>
+    void printStructure(PackWriter &out, const uchar *data, uint32_t structure, int mask);
+
+    template<typename D>
+    void printField(XmlWriter &out, const uchar *data, const FieldLayout &field, int mask);
+    template<typename D>
+    void printField(PackWriter &out, const uchar *data, const FieldLayout &field, int mask);
+
+    template<typename D>
+    void printReference(XmlWriter &out, const uchar *data, uint32_t count);
+
+    template<typename D>
+    void printPointer(PackWriter &out, const uchar *data);
 };
 
 #endif // BLENDTOXML_H
@@ -0,0 +1,97 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "blockindex.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+static const quint32 IndexMagic = 0x42325849; // "B2XI"
+static const quint32 IndexVersion = 2;
+
+QString BlockIndex::pathFor(const QString &source)
+{
+    return source + ".idx";
+}
+
+bool BlockIndex::load(const QString &path, const QFileInfo &source)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    qint64 size, modified;
+    stream >> magic >> version >> size >> modified;
+    if (magic != IndexMagic || version != IndexVersion ||
+        size != source.size() || modified != source.lastModified().toMSecsSinceEpoch()) {
+        return false;
+    }
+
+    QByteArray names;
+    quint32 count;
+    stream >> header >> dna >> names >> count;
+    idNames.setData(names);
+    blocks.clear();
+    blocks.reserve(static_cast<int>(qMin<quint32>(count, 1 << 24)));
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        Block b;
+        quint64 address;
+        if (stream.readRawData(b.code, sizeof(b.code)) != sizeof(b.code)) {
+            return false;
+        }
+        stream >> b.size >> address >> b.sdnaIndex >> b.count >> b.pos >> b.idName;
+        b.oldMemoryAddress = address;
+        b.index = 0;
+        // A damaged index is rejected, the caller then scans the file
+        if (b.idName < -1 || b.idName >= idNames.length() ||
+            b.pos < 0 || b.pos > size || b.size > size - b.pos) {
+            return false;
+        }
+        blocks.append(b);
+    }
+
+    return stream.status() == QDataStream::Ok;
+}
+
+bool BlockIndex::save(const QString &path, const QFileInfo &source) const
+{
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    stream << IndexMagic << IndexVersion << source.size() << source.lastModified().toMSecsSinceEpoch();
+    stream << header << dna << idNames.data() << static_cast<quint32>(blocks.length());
+    for (const Block &b : blocks) {
+        stream.writeRawData(b.code, sizeof(b.code));
+        stream << b.size << static_cast<quint64>(b.oldMemoryAddress) << b.sdnaIndex << b.count << b.pos << b.idName;
+    }
+
+    return stream.status() == QDataStream::Ok && file.commit();
+}
@@ -0,0 +1,52 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef BLOCKINDEX_H
+#define BLOCKINDEX_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QString>
+#include <QVector>
+
+#include "blendfile.h"
+
+class QFileInfo;
+
+/*
+ * Sidecar file with the block table and the DNA1 block of a .blend file,
+ * so that --select can seek straight to the blocks it needs instead of
+ * scanning every block header. The index records the size and
+ * modification time of the source and is ignored once they change.
+ */
+class BlockIndex
+{
+public:
+    QByteArray header;
+    QVector<Block> blocks;
+    StringTable idNames;
+    QByteArray dna;
+
+    static QString pathFor(const QString &source);
+
+    bool load(const QString &path, const QFileInfo &source);
+    bool save(const QString &path, const QFileInfo &source) const;
+};
+
+#endif // BLOCKINDEX_H
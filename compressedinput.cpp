@@ -0,0 +1,314 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "compressedinput.h"
+#include "blenderror.h"
+
+#include <cstring>
+#include <limits>
+#include <QIODevice>
+
+static const qint64 ChunkSize = 256 * 1024;
+static const qint64 MaxDirectRead = 16 * 1024 * 1024;
+
+CompressedInput::Format CompressedInput::detect(const QByteArray &magic)
+{
+    if (magic.startsWith("\x1f\x8b")) {
+        return Gzip;
+    }
+    if (magic.startsWith("\x28\xb5\x2f\xfd")) {
+        return Zstd;
+    }
+    return Unknown;
+}
+
+CompressedInput *CompressedInput::create(QIODevice *device, Format format)
+{
+    switch (format) {
+    case Gzip:
+#ifdef HAVE_ZLIB
+        return new GzipInput(device);
+#else
+        blendError("This build of blend2xml does not support gzip compressed files");
+#endif
+    case Zstd:
+#ifdef HAVE_ZSTD
+        return new ZstdInput(device);
+#else
+        blendError("This build of blend2xml does not support zstd compressed files");
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+CompressedInput::CompressedInput(QIODevice *device)
+    : m_device(device), m_out(0), m_bufferPos(0)
+{
+    addSeekPoint(0, 0);
+}
+
+QByteArray CompressedInput::read(qint64 pos, qint64 len)
+{
+    QByteArray result;
+
+    while (len > 0) {
+        if (pos >= m_bufferPos && pos < m_bufferPos + m_buffer.size()) {
+            qint64 n = qMin(len, m_bufferPos + m_buffer.size() - pos);
+            result.append(m_buffer.constData() + (pos - m_bufferPos), static_cast<int>(n));
+            pos += n;
+            len -= n;
+            continue;
+        }
+
+        if (pos < m_out) {
+            int i = m_seekPoints.length() - 1;
+            while (m_seekPoints[i].out > pos) {
+                i--;
+            }
+            if (m_device->isSequential()) {
+                blendError("Cannot seek backwards in compressed input that is not seekable");
+            }
+            restart(m_seekPoints[i]);
+            m_out = m_seekPoints[i].out;
+            m_buffer.clear();
+            m_bufferPos = m_out;
+        }
+
+        if (pos == m_out && len >= ChunkSize) {
+            // Decode large reads straight into the result
+            int offset = result.size();
+            qint64 n = qMin(len, MaxDirectRead);
+            result.resize(offset + static_cast<int>(n));
+            qint64 produced = decompress(result.data() + offset, n);
+            result.resize(offset + static_cast<int>(produced));
+            m_out += produced;
+            m_buffer.clear();
+            m_bufferPos = m_out;
+            if (!produced) {
+                break;
+            }
+            pos += produced;
+            len -= produced;
+            continue;
+        }
+
+        m_buffer.resize(static_cast<int>(ChunkSize));
+        qint64 produced = decompress(m_buffer.data(), ChunkSize);
+        m_buffer.resize(static_cast<int>(produced));
+        m_bufferPos = m_out;
+        m_out += produced;
+        if (!produced) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+QByteArray CompressedInput::readAll()
+{
+    return read(0, std::numeric_limits<int>::max());
+}
+
+bool CompressedInput::needsSeekPoint(qint64 out) const
+{
+    return m_seekPoints.isEmpty() || out >= m_seekPoints.last().out + SeekPointSpan;
+}
+
+void CompressedInput::addSeekPoint(qint64 in, qint64 out, int bits, const QByteArray &window)
+{
+    if (!needsSeekPoint(out)) {
+        return;
+    }
+
+    SeekPoint point;
+    point.in = in;
+    point.out = out;
+    point.bits = bits;
+    point.window = window;
+    m_seekPoints.append(point);
+}
+
+#ifdef HAVE_ZLIB
+GzipInput::GzipInput(QIODevice *device)
+    : CompressedInput(device), m_inputEnd(0), m_finished(false)
+{
+    memset(&m_stream, 0, sizeof(m_stream));
+    if (inflateInit2(&m_stream, 15 + 16) != Z_OK) {
+        blendError("gzip: %s", m_stream.msg ? m_stream.msg : "cannot initialize decoder");
+    }
+    m_input.resize(static_cast<int>(ChunkSize));
+}
+
+GzipInput::~GzipInput()
+{
+    inflateEnd(&m_stream);
+}
+
+/*
+ * Seek points are taken at deflate block boundaries, the same way as in
+ * zlib's examples/zran.c: the decoder is restarted in raw mode, primed
+ * with the bits of the partially consumed byte and given the last 32K of
+ * output as its dictionary.
+ */
+void GzipInput::restart(const SeekPoint &point)
+{
+    m_finished = false;
+    m_stream.avail_in = 0;
+    m_history = point.window;
+
+    qint64 in = point.in - (point.bits ? 1 : 0);
+    if (!m_device->seek(in)) {
+        blendError("gzip: cannot seek to offset %lld", in);
+    }
+    m_inputEnd = in;
+
+    if (point.window.isEmpty()) {
+        inflateReset2(&m_stream, 15 + 16);
+        return;
+    }
+
+    inflateReset2(&m_stream, -15);
+    if (point.bits) {
+        char byte;
+        if (!m_device->getChar(&byte)) {
+            blendError("gzip: unexpected end of compressed data");
+        }
+        m_inputEnd++;
+        inflatePrime(&m_stream, point.bits, static_cast<uchar>(byte) >> (8 - point.bits));
+    }
+    inflateSetDictionary(&m_stream, reinterpret_cast<const Bytef *>(point.window.constData()), point.window.size());
+}
+
+qint64 GzipInput::decompress(char *data, qint64 len)
+{
+    m_stream.next_out = reinterpret_cast<Bytef *>(data);
+    m_stream.avail_out = static_cast<uInt>(len);
+
+    while (m_stream.avail_out && !m_finished) {
+        if (!m_stream.avail_in) {
+            qint64 n = m_device->read(m_input.data(), m_input.size());
+            if (n <= 0) {
+                break;
+            }
+            m_stream.next_in = reinterpret_cast<Bytef *>(m_input.data());
+            m_stream.avail_in = static_cast<uInt>(n);
+            m_inputEnd += n;
+        }
+
+        int ret = inflate(&m_stream, Z_BLOCK);
+        if (ret == Z_STREAM_END) {
+            m_finished = true;
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            blendError("gzip: %s", m_stream.msg ? m_stream.msg : "invalid compressed data");
+        }
+
+        // End of a deflate block that is not the last one
+        if ((m_stream.data_type & 128) && !(m_stream.data_type & 64)) {
+            qint64 produced = len - m_stream.avail_out;
+            if (needsSeekPoint(m_out + produced)) {
+                addSeekPoint(m_inputEnd - m_stream.avail_in, m_out + produced,
+                             m_stream.data_type & 7, window(data, produced));
+            }
+        }
+    }
+
+    qint64 produced = len - m_stream.avail_out;
+    m_history = window(data, produced);
+    return produced;
+}
+
+QByteArray GzipInput::window(const char *data, qint64 produced) const
+{
+    if (produced >= WindowSize) {
+        return QByteArray(data + produced - WindowSize, WindowSize);
+    }
+    QByteArray result = m_history.right(WindowSize - static_cast<int>(produced));
+    result.append(data, static_cast<int>(produced));
+    return result;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+ZstdInput::ZstdInput(QIODevice *device)
+    : CompressedInput(device), m_context(ZSTD_createDCtx()), m_inputEnd(0), m_frameStart(true)
+{
+    if (!m_context) {
+        blendError("zstd: cannot initialize decoder");
+    }
+    m_input.resize(static_cast<int>(ZSTD_DStreamInSize()));
+    m_inBuffer.src = m_input.constData();
+    m_inBuffer.size = 0;
+    m_inBuffer.pos = 0;
+}
+
+ZstdInput::~ZstdInput()
+{
+    ZSTD_freeDCtx(m_context);
+}
+
+/*
+ * Frames are decoded independently, so every frame boundary is a seek
+ * point. Blender writes files as a sequence of small frames.
+ */
+void ZstdInput::restart(const SeekPoint &point)
+{
+    ZSTD_DCtx_reset(m_context, ZSTD_reset_session_only);
+    if (!m_device->seek(point.in)) {
+        blendError("zstd: cannot seek to offset %lld", point.in);
+    }
+    m_inputEnd = point.in;
+    m_inBuffer.size = 0;
+    m_inBuffer.pos = 0;
+    m_frameStart = true;
+}
+
+qint64 ZstdInput::decompress(char *data, qint64 len)
+{
+    ZSTD_outBuffer output = { data, static_cast<size_t>(len), 0 };
+
+    while (output.pos < output.size) {
+        if (m_inBuffer.pos == m_inBuffer.size) {
+            qint64 n = m_device->read(m_input.data(), m_input.size());
+            if (n <= 0) {
+                break;
+            }
+            m_inBuffer.src = m_input.constData();
+            m_inBuffer.size = static_cast<size_t>(n);
+            m_inBuffer.pos = 0;
+            m_inputEnd += n;
+        }
+
+        if (m_frameStart && needsSeekPoint(m_out + output.pos)) {
+            addSeekPoint(m_inputEnd - static_cast<qint64>(m_inBuffer.size - m_inBuffer.pos), m_out + output.pos);
+        }
+
+        size_t ret = ZSTD_decompressStream(m_context, &output, &m_inBuffer);
+        if (ZSTD_isError(ret)) {
+            blendError("zstd: %s", ZSTD_getErrorName(ret));
+        }
+        m_frameStart = ret == 0;
+    }
+
+    return static_cast<qint64>(output.pos);
+}
+#endif
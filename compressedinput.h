@@ -0,0 +1,133 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef COMPRESSEDINPUT_H
+#define COMPRESSEDINPUT_H
+
+#include "blendinput.h"
+
+#include <QList>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Decompresses a gzip or zstd .blend file on the fly. Decoded bytes are
+ * produced sequentially into a small window; while decoding, seek points
+ * are recorded every few megabytes so that reads behind the current
+ * position restart from the closest seek point instead of from the start
+ * of the file. Memory use is bounded by the window and the seek points,
+ * no temporary file is written.
+ */
+class CompressedInput : public BlendInput
+{
+public:
+    enum Format { Unknown, Gzip, Zstd };
+
+    static Format detect(const QByteArray &magic);
+    static CompressedInput *create(QIODevice *device, Format format);
+
+    explicit CompressedInput(QIODevice *device);
+
+    // Decompressed size is not known up front
+    qint64 size() const { return -1; }
+    QByteArray read(qint64 pos, qint64 len);
+    QByteArray readAll();
+
+protected:
+    struct SeekPoint
+    {
+        qint64 in;          // offset in the compressed stream
+        qint64 out;         // offset in the decompressed stream
+        int bits;           // gzip: bits of the byte before in
+        QByteArray window;  // gzip: last 32K of output before out
+    };
+
+    static const qint64 SeekPointSpan = 4 << 20;
+
+    QIODevice *m_device;
+    QList<SeekPoint> m_seekPoints;
+    qint64 m_out;
+
+    // Continue decoding from the given seek point.
+    virtual void restart(const SeekPoint &point) = 0;
+
+    // Decodes up to len bytes at m_out into data, returns 0 at the end of
+    // the stream. Implementations call addSeekPoint() on frame or block
+    // boundaries.
+    virtual qint64 decompress(char *data, qint64 len) = 0;
+
+    bool needsSeekPoint(qint64 out) const;
+    void addSeekPoint(qint64 in, qint64 out, int bits = 0, const QByteArray &window = QByteArray());
+
+private:
+    QByteArray m_buffer;
+    qint64 m_bufferPos;
+};
+
+#ifdef HAVE_ZLIB
+class GzipInput : public CompressedInput
+{
+public:
+    explicit GzipInput(QIODevice *device);
+    ~GzipInput();
+
+protected:
+    void restart(const SeekPoint &point);
+    qint64 decompress(char *data, qint64 len);
+
+private:
+    static const int WindowSize = 32768;
+
+    z_stream m_stream;
+    QByteArray m_input;
+    qint64 m_inputEnd;
+    QByteArray m_history;
+    bool m_finished;
+
+    QByteArray window(const char *data, qint64 produced) const;
+};
+#endif
+
+#ifdef HAVE_ZSTD
+class ZstdInput : public CompressedInput
+{
+public:
+    explicit ZstdInput(QIODevice *device);
+    ~ZstdInput();
+
+protected:
+    void restart(const SeekPoint &point);
+    qint64 decompress(char *data, qint64 len);
+
+private:
+    ZSTD_DCtx *m_context;
+    QByteArray m_input;
+    ZSTD_inBuffer m_inBuffer;
+    qint64 m_inputEnd;
+    bool m_frameStart;
+};
+#endif
+
+#endif // COMPRESSEDINPUT_H
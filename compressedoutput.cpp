@@ -0,0 +1,269 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "compressedoutput.h"
+
+#include <cstring>
+#include <QMutexLocker>
+
+// Bytes collected before they are handed to the compression thread
+static const int BufferSize = 1 << 20;
+// Buffers waiting for the compression thread before writers block
+static const int MaxQueued = 4;
+
+CompressedOutput::CompressedOutput(QIODevice *device, Format format, int threads)
+    : m_device(device), m_format(format), m_threads(threads), m_finishing(false)
+{
+    setAutoDelete(false);
+    m_pool.setMaxThreadCount(1);
+#ifdef HAVE_ZLIB
+    memset(&m_stream, 0, sizeof(m_stream));
+#endif
+#ifdef HAVE_ZSTD
+    m_context = nullptr;
+#endif
+}
+
+CompressedOutput::~CompressedOutput()
+{
+    close();
+#ifdef HAVE_ZLIB
+    if (m_format == Gzip) {
+        deflateEnd(&m_stream);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(m_context);
+#endif
+}
+
+bool CompressedOutput::isSupported(Format format)
+{
+    switch (format) {
+#ifdef HAVE_ZLIB
+    case Gzip:
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    case Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+bool CompressedOutput::open(OpenMode mode)
+{
+    if (mode != WriteOnly) {
+        setErrorString("Compressed output is write only");
+        return false;
+    }
+    if (!isSupported(m_format)) {
+        setErrorString(QString("This build of blend2xml does not support %1 output").arg(m_format == Gzip ? "gzip" : "zstd"));
+        return false;
+    }
+
+#ifdef HAVE_ZLIB
+    if (m_format == Gzip) {
+        // 15 + 16: the largest window with a gzip header
+        if (deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            setErrorString("gzip: cannot initialize encoder");
+            return false;
+        }
+        m_output.resize(BufferSize);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (m_format == Zstd) {
+        m_context = ZSTD_createCCtx();
+        if (!m_context) {
+            setErrorString("zstd: cannot initialize encoder");
+            return false;
+        }
+        // Fails harmlessly when libzstd was built without thread support
+        if (m_threads > 1) {
+            ZSTD_CCtx_setParameter(m_context, ZSTD_c_nbWorkers, m_threads);
+        }
+        m_output.resize(static_cast<int>(ZSTD_CStreamOutSize()));
+    }
+#endif
+
+    m_buffer.reserve(BufferSize);
+    m_pool.start(this);
+    return QIODevice::open(mode);
+}
+
+void CompressedOutput::close()
+{
+    if (isOpen()) {
+        finish();
+    }
+}
+
+bool CompressedOutput::finish()
+{
+    if (isOpen()) {
+        enqueue();
+        {
+            QMutexLocker locker(&m_mutex);
+            m_finishing = true;
+            m_queued.wakeAll();
+        }
+        m_pool.waitForDone();
+        QIODevice::close();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_error.isEmpty()) {
+        setErrorString(m_error);
+        return false;
+    }
+    return true;
+}
+
+qint64 CompressedOutput::readData(char *, qint64)
+{
+    return -1;
+}
+
+qint64 CompressedOutput::writeData(const char *data, qint64 len)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_error.isEmpty()) {
+            setErrorString(m_error);
+            return -1;
+        }
+    }
+
+    m_buffer.append(data, static_cast<int>(len));
+    if (m_buffer.size() >= BufferSize) {
+        enqueue();
+    }
+    return len;
+}
+
+// Hands the filled buffer to the compression thread
+void CompressedOutput::enqueue()
+{
+    if (m_buffer.isEmpty()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    while (m_queue.length() >= MaxQueued && m_error.isEmpty()) {
+        m_taken.wait(&m_mutex);
+    }
+    m_queue.append(m_buffer);
+    m_queued.wakeAll();
+    m_buffer = QByteArray();
+    m_buffer.reserve(BufferSize);
+}
+
+/*
+ * Runs on the compression thread until finish() is called and the queue
+ * is empty. After an error the queue is drained without compressing, so
+ * that writers never block on a thread that has given up.
+ */
+void CompressedOutput::run()
+{
+    bool failed = false;
+    for (;;) {
+        QByteArray data;
+        bool end;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_finishing) {
+                m_queued.wait(&m_mutex);
+            }
+            if (!m_queue.isEmpty()) {
+                data = m_queue.takeFirst();
+                m_taken.wakeAll();
+            }
+            end = m_finishing && m_queue.isEmpty();
+        }
+
+        if (!failed && !compress(data, end)) {
+            failed = true;
+            QMutexLocker locker(&m_mutex);
+            m_taken.wakeAll();
+        }
+        if (end) {
+            return;
+        }
+    }
+}
+
+bool CompressedOutput::compress(const QByteArray &data, bool end)
+{
+#ifdef HAVE_ZLIB
+    if (m_format == Gzip) {
+        m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+        m_stream.avail_in = static_cast<uInt>(data.size());
+        int ret;
+        do {
+            m_stream.next_out = reinterpret_cast<Bytef *>(m_output.data());
+            m_stream.avail_out = static_cast<uInt>(m_output.size());
+            ret = deflate(&m_stream, end ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR) {
+                QMutexLocker locker(&m_mutex);
+                m_error = QString("gzip: %1").arg(m_stream.msg ? m_stream.msg : "compression failed");
+                return false;
+            }
+            if (!writeOutput(m_output.size() - m_stream.avail_out)) {
+                return false;
+            }
+        } while (m_stream.avail_out == 0 || (end && ret != Z_STREAM_END));
+        return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (m_format == Zstd) {
+        ZSTD_inBuffer in = { data.constData(), static_cast<size_t>(data.size()), 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out = { m_output.data(), static_cast<size_t>(m_output.size()), 0 };
+            remaining = ZSTD_compressStream2(m_context, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) {
+                QMutexLocker locker(&m_mutex);
+                m_error = QString("zstd: %1").arg(ZSTD_getErrorName(remaining));
+                return false;
+            }
+            if (!writeOutput(static_cast<qint64>(out.pos))) {
+                return false;
+            }
+        } while (end ? remaining != 0 : in.pos < in.size);
+        return true;
+    }
+#endif
+    Q_UNUSED(data);
+    Q_UNUSED(end);
+    return false;
+}
+
+bool CompressedOutput::writeOutput(qint64 len)
+{
+    if (len > 0 && m_device->write(m_output.constData(), len) != len) {
+        QMutexLocker locker(&m_mutex);
+        m_error = QString("write: %1").arg(m_device->errorString());
+        return false;
+    }
+    return true;
+}
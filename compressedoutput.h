@@ -0,0 +1,96 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef COMPRESSEDOUTPUT_H
+#define COMPRESSEDOUTPUT_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Write-only device that compresses everything written to it into another
+ * device. Written data is collected into large buffers, which a separate
+ * thread takes from a short queue, compresses and writes, so formatting
+ * and compression overlap. zstd may compress on several threads of its own.
+ */
+class CompressedOutput : public QIODevice, private QRunnable
+{
+public:
+    enum Format { Gzip, Zstd };
+
+    // device must be open for writing and outlive this object
+    CompressedOutput(QIODevice *device, Format format, int threads = 1);
+    ~CompressedOutput();
+
+    static bool isSupported(Format format);
+
+    bool open(OpenMode mode);
+    void close();
+    bool isSequential() const { return true; }
+
+    // Compresses what is left and ends the stream; false if compressing or
+    // writing failed, with the reason in errorString()
+    bool finish();
+
+protected:
+    qint64 readData(char *data, qint64 maxlen);
+    qint64 writeData(const char *data, qint64 len);
+
+private:
+    QIODevice *m_device;
+    Format m_format;
+    int m_threads;
+    QByteArray m_buffer;
+    QByteArray m_output;
+
+    QMutex m_mutex;
+    QWaitCondition m_queued;
+    QWaitCondition m_taken;
+    QList<QByteArray> m_queue;
+    bool m_finishing;
+    QString m_error;
+    QThreadPool m_pool;
+
+#ifdef HAVE_ZLIB
+    z_stream m_stream;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *m_context;
+#endif
+
+    void enqueue();
+    void run();
+    bool compress(const QByteArray &data, bool end);
+    bool writeOutput(qint64 len);
+};
+
+#endif // COMPRESSEDOUTPUT_H
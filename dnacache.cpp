@@ -0,0 +1,218 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "dnacache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+
+static const quint32 CacheMagic = 0x42325844; // "B2XD"
+static const quint32 CacheVersion = 2;
+
+QByteArray DnaCache::keyFor(const QByteArray &dna, int pointerSize)
+{
+    return QCryptographicHash::hash(dna, QCryptographicHash::Sha1).toHex() + "-" + QByteArray::number(pointerSize);
+}
+
+QString DnaCache::pathFor(const QString &directory, const QByteArray &key)
+{
+    return QDir(directory).filePath(QString::fromLatin1(key) + ".sdna");
+}
+
+bool DnaCache::load(const QString &path, const QByteArray &key)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    QByteArray storedKey;
+    stream >> magic >> version >> storedKey;
+    if (magic != CacheMagic || version != CacheVersion || storedKey != key) {
+        return false;
+    }
+
+    QByteArray nameData, typeData;
+    quint32 count;
+    stream >> nameData >> typeData >> count;
+    names.setData(nameData);
+    typenames.setData(typeData);
+    typelengths.clear();
+    typestructures.clear();
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        quint16 length;
+        quint32 structure;
+        stream >> length >> structure;
+        typelengths.append(length);
+        typestructures.append(structure);
+    }
+
+    stream >> count;
+    structures.clear();
+    layouts.clear();
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        Structure s;
+        StructLayout layout;
+        quint32 fields;
+        stream >> s.type >> layout.tag >> layout.size >> layout.idNameOffset >> layout.idNameLength >> fields;
+        for (quint32 j = 0; j < fields && stream.status() == QDataStream::Ok; j++) {
+            Field f;
+            FieldLayout l;
+            quint8 kind;
+            stream >> f.type >> f.name >> kind >> l.structure >> l.offset >> l.size >> l.width >> l.height
+                   >> l.isPad >> l.isFlag >> l.isText >> l.tag >> l.printType;
+            l.kind = static_cast<FieldLayout::Kind>(kind);
+            l.type = f.type;
+            s.fields.append(f);
+            layout.fields.append(l);
+        }
+        structures.append(s);
+        layouts.append(layout);
+    }
+
+    return stream.status() == QDataStream::Ok && isConsistent(static_cast<uint32_t>(key.mid(key.lastIndexOf('-') + 1).toInt()));
+}
+
+/*
+ * A damaged or foreign cache file must not index past the tables it
+ * brought along; load() then fails and DNA1 is parsed instead.
+ */
+bool DnaCache::isConsistent(uint32_t pointerSize) const
+{
+    const int types = typenames.length();
+    const uint32_t count = static_cast<uint32_t>(structures.length());
+    if (typelengths.length() != types || typestructures.length() != types) {
+        return false;
+    }
+    for (uint32_t structure : typestructures) {
+        if (structure != BlendFile::NOTYPE && structure >= count) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < structures.length(); i++) {
+        const Structure &s = structures[i];
+        const StructLayout &layout = layouts[i];
+        if (s.type >= types || typestructures[s.type] != static_cast<uint32_t>(i) || s.fields.length() != layout.fields.length()) {
+            return false;
+        }
+        if (layout.idNameOffset < -1 || (layout.idNameOffset >= 0 && static_cast<quint64>(layout.idNameOffset) + layout.idNameLength > layout.size)) {
+            return false;
+        }
+        quint64 offset = 0;
+        for (int j = 0; j < s.fields.length(); j++) {
+            const Field &f = s.fields[j];
+            const FieldLayout &l = layout.fields[j];
+            if (f.type >= types || f.name >= names.length() || l.kind > FieldLayout::Struct ||
+                (l.structure != BlendFile::NOTYPE && l.structure >= count) ||
+                (l.kind == FieldLayout::Struct && l.structure == BlendFile::NOTYPE) ||
+                l.offset != offset || static_cast<quint64>(elementSize(l, pointerSize)) * l.width * l.height != l.size) {
+                return false;
+            }
+            offset += l.size;
+        }
+        if (offset != layout.size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The size of one element of a field as its kind reads it
+uint32_t DnaCache::elementSize(const FieldLayout &field, uint32_t pointerSize) const
+{
+    switch (field.kind) {
+    case FieldLayout::Char:
+    case FieldLayout::Int8:
+        return 1;
+    case FieldLayout::Int16:
+        return 2;
+    case FieldLayout::Int32:
+    case FieldLayout::Float:
+        return 4;
+    case FieldLayout::Int64:
+    case FieldLayout::Double:
+        return 8;
+    case FieldLayout::Pointer:
+        return pointerSize;
+    case FieldLayout::Struct:
+        return layouts[field.structure].size;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Several conversions may fill the cache at the same time, so the file
+ * is written to a temporary name and renamed when complete.
+ */
+bool DnaCache::save(const QString &path, const QByteArray &key) const
+{
+    QDir().mkpath(QFileInfo(path).path());
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    stream << CacheMagic << CacheVersion << key;
+    stream << names.data() << typenames.data() << static_cast<quint32>(typelengths.length());
+    for (int i = 0; i < typelengths.length(); i++) {
+        stream << typelengths[i] << typestructures[i];
+    }
+
+    stream << static_cast<quint32>(structures.length());
+    for (int i = 0; i < structures.length(); i++) {
+        const Structure &s = structures[i];
+        const StructLayout &layout = layouts[i];
+        stream << s.type << layout.tag << layout.size << layout.idNameOffset << layout.idNameLength << static_cast<quint32>(s.fields.length());
+        for (int j = 0; j < s.fields.length(); j++) {
+            const Field &f = s.fields[j];
+            const FieldLayout &l = layout.fields[j];
+            stream << f.type << f.name << static_cast<quint8>(l.kind) << l.structure << l.offset << l.size << l.width << l.height
+                   << l.isPad << l.isFlag << l.isText << l.tag << l.printType;
+        }
+    }
+
+    return stream.status() == QDataStream::Ok && file.commit();
+}
+
+std::shared_ptr<const DnaCache> SharedDnaCache::find(const QByteArray &key) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_entries.value(key);
+}
+
+void SharedDnaCache::insert(const QByteArray &key, const std::shared_ptr<const DnaCache> &cache)
+{
+    QMutexLocker locker(&m_mutex);
+    m_entries.insert(key, cache);
+}
@@ -0,0 +1,76 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef DNACACHE_H
+#define DNACACHE_H
+
+#include <memory>
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+#include "blendfile.h"
+
+/*
+ * Parsed SDNA tables and field layouts of one DNA1 block, stored in a
+ * cache directory under the hash of the raw DNA1 bytes. Files written by
+ * the same Blender build share their SDNA, so a batch of them only parses
+ * it once.
+ */
+class DnaCache
+{
+public:
+    StringTable names;
+    StringTable typenames;
+    QList<uint16_t> typelengths;
+    QList<uint32_t> typestructures;
+    QList<Structure> structures;
+    QList<StructLayout> layouts;
+
+    // Layouts depend on the pointer size, which is part of the key
+    static QByteArray keyFor(const QByteArray &dna, int pointerSize);
+    static QString pathFor(const QString &directory, const QByteArray &key);
+
+    bool load(const QString &path, const QByteArray &key);
+    bool save(const QString &path, const QByteArray &key) const;
+
+private:
+    bool isConsistent(uint32_t pointerSize) const;
+    uint32_t elementSize(const FieldLayout &field, uint32_t pointerSize) const;
+};
+
+/*
+ * Parsed SDNA shared by the conversions running in one process, so that
+ * a batch parses or loads every distinct DNA1 block only once.
+ */
+class SharedDnaCache
+{
+public:
+    std::shared_ptr<const DnaCache> find(const QByteArray &key) const;
+    void insert(const QByteArray &key, const std::shared_ptr<const DnaCache> &cache);
+
+private:
+    mutable QMutex m_mutex;
+    QHash<QByteArray, std::shared_ptr<const DnaCache>> m_entries;
+};
+
+#endif // DNACACHE_H
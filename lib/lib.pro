@@ -0,0 +1,6 @@
+TARGET = blend2xml
+CONFIG   += staticlib
+
+TEMPLATE = lib
+
+include(../blend2xml.pri)
@@ -17,15 +17,413 @@
  * ***** END GPL LICENSE BLOCK *****
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <memory>
 
+#include <QDir>
 #include <QFile>
 #include <QTimer>
+#include <QMutex>
+#include <QThread>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QJsonArray>
+#include <QJsonObject>
 #include <QTextStream>
+#include <QThreadPool>
+#include <QLocalSocket>
+#include <QMutexLocker>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QStandardPaths>
 #include <QCoreApplication>
 #include <QCommandLineParser>
 
+#include "arrayextractor.h"
+#include "blenderror.h"
+#include "blendserver.h"
 #include "blendtoxml.h"
+#include "blockindex.h"
+#include "compressedoutput.h"
+#include "dnacache.h"
+#include "memoryusage.h"
+
+/*
+ * Options that apply to every converted file.
+ */
+struct Settings
+{
+    BlendToXml::Format format;
+    BlendToXml::Deduplication deduplication;
+    bool notypes;
+    bool nodata;
+    bool printRawPointers;
+    bool references;
+    bool streaming;
+    bool buildIndex;
+    bool statistics;
+    bool summary;
+    bool headersOnly;
+    int jobs;
+    qint64 readAhead;
+    QString cachePath;
+    QString compression;    // gzip, zstd, none or empty to go by the output name
+    QStringList selection;
+    QStringList fields;
+    QStringList extract;
+};
+
+static void configure(BlendToXml *task, const Settings &settings, const QString &source)
+{
+    task->setJobs(settings.jobs);
+    task->setReadAhead(settings.readAhead);
+    task->setStreaming(settings.streaming);
+    if (source != "-") {
+        task->setIndexPath(BlockIndex::pathFor(source));
+    }
+    task->setCachePath(settings.cachePath);
+    task->setBuildIndex(settings.buildIndex);
+    task->setSelection(settings.selection);
+    task->setReferences(settings.references);
+    task->setFormat(settings.format);
+    task->setFields(settings.fields);
+    task->setDeduplication(settings.deduplication);
+    task->setStatistics(settings.statistics);
+    task->setSummary(settings.summary);
+    task->setHeadersOnly(settings.headersOnly);
+}
+
+// Statistics of one converted file, for --stats and --stats-json
+struct FileReport
+{
+    QString source;
+    QString error;
+    PhaseTimings timings;
+    ConversionStats stats;
+    MemoryUsage memory; // of the whole process when the file was done
+};
+
+static double milliseconds(qint64 nanoseconds)
+{
+    return nanoseconds / 1e6;
+}
+
+static double megabytes(quint64 bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+/*
+ * Writes the phase times and the blocks written per structure type, the
+ * types that took longest first.
+ */
+static void printReport(QTextStream &out, const FileReport &report)
+{
+    const PhaseTimings &timings = report.timings;
+    out << QString("%1: scan %2 ms, dna %3 ms, types %4 ms, data %5 ms, %6 blocks, %7 MB\n")
+           .arg(report.source)
+           .arg(milliseconds(timings.scan), 0, 'f', 1)
+           .arg(milliseconds(timings.dna), 0, 'f', 1)
+           .arg(milliseconds(timings.types), 0, 'f', 1)
+           .arg(milliseconds(timings.data), 0, 'f', 1)
+           .arg(report.stats.blocks)
+           .arg(megabytes(report.stats.bytes), 0, 'f', 1);
+    if (report.memory.peakResident >= 0) {
+        out << QString("  peak RSS %1 MB").arg(megabytes(report.memory.peakResident), 0, 'f', 1);
+        if (report.memory.heapInUse >= 0) {
+            out << QString(", heap in use %1 MB").arg(megabytes(report.memory.heapInUse), 0, 'f', 1);
+        }
+        out << "\n";
+    }
+
+    QList<TypeStats> types = report.stats.types;
+    std::sort(types.begin(), types.end(), [](const TypeStats &a, const TypeStats &b) { return a.time > b.time; });
+    for (const TypeStats &type : types) {
+        out << QString("  %1 %2 blocks %3 MB %4 ms\n")
+               .arg(QString::fromUtf8(type.type), -24)
+               .arg(type.blocks, 9)
+               .arg(megabytes(type.bytes), 9, 'f', 1)
+               .arg(milliseconds(type.time), 9, 'f', 1);
+    }
+    out.flush();
+}
+
+static QJsonObject reportJson(const FileReport &report)
+{
+    QJsonObject phases;
+    phases["scan"] = milliseconds(report.timings.scan);
+    phases["dna"] = milliseconds(report.timings.dna);
+    phases["types"] = milliseconds(report.timings.types);
+    phases["data"] = milliseconds(report.timings.data);
+
+    QJsonArray types;
+    for (const TypeStats &type : report.stats.types) {
+        QJsonObject entry;
+        entry["type"] = QString::fromUtf8(type.type);
+        entry["blocks"] = static_cast<qint64>(type.blocks);
+        entry["bytes"] = static_cast<qint64>(type.bytes);
+        entry["ms"] = milliseconds(type.time);
+        types.append(entry);
+    }
+
+    QJsonObject result;
+    result["file"] = report.source;
+    if (!report.error.isEmpty()) {
+        result["error"] = report.error;
+    }
+    result["blocks"] = static_cast<qint64>(report.stats.blocks);
+    result["bytes"] = static_cast<qint64>(report.stats.bytes);
+    result["phases"] = phases;
+    result["types"] = types;
+    if (report.memory.peakResident >= 0) {
+        result["peak_rss"] = report.memory.peakResident;
+    }
+    if (report.memory.heapInUse >= 0) {
+        result["heap_in_use"] = report.memory.heapInUse;
+    }
+    return result;
+}
+
+// The summary is {"files": [...]} with one report per source
+static bool writeReports(const QString &path, const QList<FileReport> &reports, QTextStream &qerr)
+{
+    QJsonArray files;
+    for (const FileReport &report : reports) {
+        files.append(reportJson(report));
+    }
+    QJsonObject root;
+    root["files"] = files;
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(root).toJson()) < 0 || !file.commit()) {
+        qerr << QString("write %1: %2\n").arg(path, file.errorString());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Expands {dir} and {name} in an output template: "models/chair.blend"
+ * has the dir "models" and the name "chair".
+ */
+static QString outputPathFor(const QString &pattern, const QString &source)
+{
+    QFileInfo info(source);
+    QString name = info.fileName();
+    for (const char *suffix : { ".gz", ".zst" }) {
+        if (name.endsWith(suffix)) {
+            name.chop(static_cast<int>(strlen(suffix)));
+        }
+    }
+    if (name.endsWith(".blend")) {
+        name.chop(6);
+    }
+
+    QString path = pattern;
+    path.replace("{dir}", info.path());
+    path.replace("{name}", name);
+    return path;
+}
+
+/*
+ * Compression of an output: the --compress format, or the one implied by
+ * a .gz or .zst output name.
+ */
+static bool outputCompression(const Settings &settings, const QString &path, CompressedOutput::Format *format)
+{
+    QString name = settings.compression;
+    if (name.isEmpty()) {
+        name = path.endsWith(".gz") ? "gzip" : path.endsWith(".zst") ? "zstd" : "none";
+    }
+    *format = name == "zstd" ? CompressedOutput::Zstd : CompressedOutput::Gzip;
+    return name != "none";
+}
+
+/*
+ * Writes each --extract field of a source to "<prefix>.<path>.npy", e.g.
+ * "models/chair.MVert.co.npy".
+ */
+static QString extractFile(const QString &source, const QString &prefix, const Settings &settings, SharedDnaCache *cache, FileReport *report)
+{
+    QFile file(source);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString("open: %1").arg(file.errorString());
+    }
+
+    try {
+        BlendFile blend(&file);
+        blend.setStreaming(settings.streaming);
+        blend.setIndexPath(BlockIndex::pathFor(source));
+        blend.setCachePath(settings.cachePath);
+        blend.setSharedCache(cache);
+        blend.load();
+        report->timings.scan = blend.scanTime();
+        report->timings.dna = blend.dnaTime();
+
+        QElapsedTimer timer;
+        timer.start();
+        ArrayExtractor extractor(blend);
+        for (const QString &path : settings.extract) {
+            QString outputPath = QString("%1.%2.npy").arg(prefix, path);
+            QDir().mkpath(QFileInfo(outputPath).path());
+            QSaveFile out(outputPath);
+            if (!out.open(QIODevice::WriteOnly)) {
+                return QString("open %1: %2").arg(outputPath, out.errorString());
+            }
+            extractor.extract(path, &out);
+            if (!out.commit()) {
+                return QString("write %1: %2").arg(outputPath, out.errorString());
+            }
+        }
+        report->timings.data = timer.nsecsElapsed();
+    } catch (const BlendError &error) {
+        return error.message();
+    }
+    return QString();
+}
+
+/*
+ * Converts one file of a batch and returns the error message, or an empty
+ * string on success. The output is written to a temporary file and only
+ * replaces the destination when the conversion succeeds.
+ */
+static QString convertFile(const QString &source, const QString &outputPath, const Settings &settings, SharedDnaCache *cache, FileReport *report)
+{
+    if (!settings.extract.isEmpty()) {
+        return extractFile(source, outputPath, settings, cache, report);
+    }
+
+    QFile file(source);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString("open: %1").arg(file.errorString());
+    }
+
+    QSaveFile outFile(outputPath);
+    if (!settings.buildIndex) {
+        QDir().mkpath(QFileInfo(outputPath).path());
+        if (!outFile.open(QIODevice::WriteOnly)) {
+            return QString("open %1: %2").arg(outputPath, outFile.errorString());
+        }
+    }
+
+    QIODevice *out = &outFile;
+    std::unique_ptr<CompressedOutput> compressed;
+    CompressedOutput::Format compression;
+    if (!settings.buildIndex && outputCompression(settings, outputPath, &compression)) {
+        compressed.reset(new CompressedOutput(&outFile, compression, settings.jobs));
+        if (!compressed->open(QIODevice::WriteOnly)) {
+            return QString("compress: %1").arg(compressed->errorString());
+        }
+        out = compressed.get();
+    }
+
+    BlendToXml task(&file, out, settings.notypes, settings.nodata, settings.printRawPointers);
+    configure(&task, settings, source);
+    task.setSharedCache(cache);
+    task.run();
+
+    report->timings = task.timings();
+    report->stats = task.statistics();
+    report->memory = memoryUsage();
+
+    if (!task.errorString().isEmpty()) {
+        return task.errorString();
+    }
+    if (compressed && !compressed->finish()) {
+        return QString("compress %1: %2").arg(outputPath, compressed->errorString());
+    }
+    if (!settings.buildIndex && !outFile.commit()) {
+        return QString("write %1: %2").arg(outputPath, outFile.errorString());
+    }
+    return QString();
+}
+
+struct BatchState
+{
+    QMutex mutex;
+    QTextStream *err;
+    bool statistics;
+    int done;
+    int failed;
+    QList<FileReport> reports;
+};
+
+class BatchTask : public QRunnable
+{
+public:
+    BatchTask(const QString &source, const QString &outputPath, const Settings &settings, SharedDnaCache *cache, BatchState *state)
+        : source(source), outputPath(outputPath), settings(settings), cache(cache), state(state) {}
+
+    void run()
+    {
+        FileReport report = {};
+        report.source = source;
+        report.error = convertFile(source, outputPath, settings, cache, &report);
+
+        QMutexLocker locker(&state->mutex);
+        state->done++;
+        if (!report.error.isEmpty()) {
+            *state->err << source << ": " << report.error << "\n";
+            state->err->flush();
+            state->failed++;
+        } else if (state->statistics) {
+            printReport(*state->err, report);
+        }
+        state->reports.append(report);
+    }
+
+private:
+    QString source;
+    QString outputPath;
+    const Settings &settings;
+    SharedDnaCache *cache;
+    BatchState *state;
+};
+
+/*
+ * Converts several files in one process. Files are converted in parallel,
+ * each on one thread of a shared pool, and files with the same DNA1 share
+ * its parsed SDNA. An error in one file is reported and the batch goes on.
+ */
+static int runBatch(const QStringList &sources, const QString &pattern, const Settings &settings, const QString &reportPath, QTextStream &qerr)
+{
+    Settings fileSettings = settings;
+    fileSettings.jobs = 1;
+
+    SharedDnaCache cache;
+    BatchState state;
+    state.err = &qerr;
+    state.statistics = settings.statistics;
+    state.done = 0;
+    state.failed = 0;
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(settings.jobs);
+    for (const QString &source : sources) {
+        pool.start(new BatchTask(source, outputPathFor(pattern, source), fileSettings, &cache, &state));
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    while (!pool.waitForDone(1000)) {
+        if (settings.statistics) {
+            QMutexLocker locker(&state.mutex);
+            qerr << QString("blend2xml: %1 of %2 files, %3 s\n").arg(state.done).arg(sources.length()).arg(clock.elapsed() / 1000);
+            qerr.flush();
+        }
+    }
+
+    if (!reportPath.isEmpty() && !writeReports(reportPath, state.reports, qerr)) {
+        return 1;
+    }
+    if (state.failed) {
+        qerr << QString("%1 of %2 files failed\n").arg(state.failed).arg(sources.length());
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -37,11 +435,18 @@ int main(int argc, char *argv[])
     QCommandLineParser parser;
     parser.addHelpOption();
     parser.addVersionOption();
-    parser.addPositionalArgument("source", "Source .blend file.");
+    parser.addPositionalArgument("source", "Source .blend files, or - for standard input.", "source...");
 
-    QCommandLineOption outputOption(QStringList() << "o" << "output", "Destination .xml file.", "file");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Destination .xml file, or a template with {dir} and {name} for several sources.", "file");
     parser.addOption(outputOption);
 
+    QCommandLineOption filesFromOption("files-from", QCoreApplication::translate("main", "Read source paths from <file>, one per line (- for standard input)."), "file");
+    parser.addOption(filesFromOption);
+    QCommandLineOption compressOption("compress", QCoreApplication::translate("main", "Compress the output: gzip, zstd or none (default: by the .gz or .zst output name)."), "format");
+    parser.addOption(compressOption);
+    QCommandLineOption formatOption("format", QCoreApplication::translate("main", "Output format: xml or msgpack."), "format", "xml");
+    parser.addOption(formatOption);
+
     QCommandLineOption notypesOption("notypes", "Disable type info.");
     parser.addOption(notypesOption);
 
@@ -51,30 +456,274 @@ int main(int argc, char *argv[])
     QCommandLineOption printRawPointersOption("rawpointers", QCoreApplication::translate("main", "Print raw pointers."));
     parser.addOption(printRawPointersOption);
 
+    QCommandLineOption jobsOption(QStringList() << "j" << "jobs", QCoreApplication::translate("main", "Format blocks on <n> threads, or convert <n> files at once (0 = all cores)."), "n", "1");
+    parser.addOption(jobsOption);
+
+    QCommandLineOption readAheadOption("read-ahead", QCoreApplication::translate("main", "Read up to <mb> megabytes of compressed or piped sources ahead of formatting (0 = off)."), "mb", "64");
+    parser.addOption(readAheadOption);
+
+    QCommandLineOption referencesOption("references", QCoreApplication::translate("main", "Resolve pointers to the blocks they point into."));
+    parser.addOption(referencesOption);
+
+    QCommandLineOption streamOption("stream", QCoreApplication::translate("main", "Read the source forward once (implied for pipes)."));
+    parser.addOption(streamOption);
+
+    QCommandLineOption indexOption("index", QCoreApplication::translate("main", "Write a block index next to the source for --select."));
+    parser.addOption(indexOption);
+
+    QCommandLineOption nocacheOption("nocache", QCoreApplication::translate("main", "Do not cache parsed SDNA between runs."));
+    parser.addOption(nocacheOption);
+
+    QCommandLineOption selectOption("select", QCoreApplication::translate("main", "Convert only blocks with this code, structure type or ID name."), "pattern");
+    parser.addOption(selectOption);
+
+    QCommandLineOption fieldsOption("fields", QCoreApplication::translate("main", "Print only these fields, e.g. Object.id.name,Object.loc (comma separated)."), "paths");
+    parser.addOption(fieldsOption);
+
+    QCommandLineOption extractOption("extract", QCoreApplication::translate("main", "Write these fields of all elements of a structure type as .npy arrays, e.g. MVert.co (comma separated)."), "paths");
+    parser.addOption(extractOption);
+
+    QCommandLineOption dedupOption("dedup", QCoreApplication::translate("main", "Write blocks with the same contents as an earlier block as a reference to it."));
+    parser.addOption(dedupOption);
+
+    QCommandLineOption dedupPointersOption("dedup-ignore-pointers", QCoreApplication::translate("main", "Like --dedup, but blocks that differ only in non-NULL pointers count as the same."));
+    parser.addOption(dedupPointersOption);
+
+    QCommandLineOption diffOption("diff", QCoreApplication::translate("main", "Compare the source with <old> and write only the blocks and fields that changed."), "old");
+    parser.addOption(diffOption);
+
+    QCommandLineOption summaryOption("summary", QCoreApplication::translate("main", "Write only the number and size of blocks per code and structure type."));
+    parser.addOption(summaryOption);
+
+    QCommandLineOption listOption("list", QCoreApplication::translate("main", "Write only the header, index and ID name of every block."));
+    parser.addOption(listOption);
+
+    QCommandLineOption serveOption("serve", QCoreApplication::translate("main", "Answer dump, list and summary requests on the local socket <name> instead of converting sources."), "name");
+    parser.addOption(serveOption);
+
+    QCommandLineOption cacheSizeOption("cache-size", QCoreApplication::translate("main", "Keep up to <n> files loaded for --serve."), "n", "256");
+    parser.addOption(cacheSizeOption);
+
+    QCommandLineOption statsOption("stats", QCoreApplication::translate("main", "Report progress and the time spent per phase and structure type on stderr."));
+    parser.addOption(statsOption);
+
+    QCommandLineOption statsJsonOption("stats-json", QCoreApplication::translate("main", "Write the statistics of every source to <file> as JSON."), "file");
+    parser.addOption(statsJsonOption);
+
     parser.process(*qApp);
 
-    const QStringList args = parser.positionalArguments();
-    if (args.count() != 1) {
+    QStringList args = parser.positionalArguments();
+    QTextStream qerr(stderr);
+
+    if (parser.isSet(filesFromOption)) {
+        QFile list;
+        if (parser.value(filesFromOption) == "-") {
+            list.open(stdin, QIODevice::ReadOnly);
+        } else {
+            list.setFileName(parser.value(filesFromOption));
+            list.open(QIODevice::ReadOnly);
+        }
+        if (list.error() != QFileDevice::NoError) {
+            qerr << QString("open %1: %2\n").arg(parser.value(filesFromOption), list.errorString());
+            return 1;
+        }
+        for (;;) {
+            // Empty only at the end, blank lines still hold their newline
+            QByteArray line = list.readLine();
+            if (line.isEmpty()) {
+                break;
+            }
+            QString path = QString::fromLocal8Bit(line).trimmed();
+            if (!path.isEmpty()) {
+                args.append(path);
+            }
+        }
+    }
+
+    bool batch = args.count() > 1 || parser.isSet(filesFromOption);
+    if ((args.isEmpty() && !parser.isSet(serveOption)) || (batch && args.contains("-"))) {
         parser.showHelp(1);
     }
 
-    QTextStream qerr(stderr);
+    Settings settings;
+    if (parser.value(formatOption) == "xml") {
+        settings.format = BlendToXml::Xml;
+    } else if (parser.value(formatOption) == "msgpack") {
+        settings.format = BlendToXml::MessagePack;
+    } else {
+        qerr << "format: expected xml or msgpack\n";
+        return 1;
+    }
 
-    QFile file(args[0]);
-    if (!file.open(QIODevice::ReadOnly)) {
-        qerr << QString("open %1: %2\n").arg(args[0], file.errorString());
+    settings.compression = parser.value(compressOption);
+    if (!settings.compression.isEmpty() && settings.compression != "gzip" && settings.compression != "zstd" && settings.compression != "none") {
+        qerr << "compress: expected gzip, zstd or none\n";
         return 1;
     }
 
+    bool jobsValid;
+    settings.jobs = parser.value(jobsOption).toInt(&jobsValid);
+    if (!jobsValid || settings.jobs < 0) {
+        qerr << "jobs: expected a non-negative number\n";
+        return 1;
+    }
+    if (settings.jobs == 0) {
+        settings.jobs = QThread::idealThreadCount();
+    }
+
+    bool readAheadValid;
+    const qint64 readAheadMegabytes = parser.value(readAheadOption).toLongLong(&readAheadValid);
+    if (!readAheadValid || readAheadMegabytes < 0 || readAheadMegabytes > (1 << 20)) {
+        qerr << "read-ahead: expected a number of megabytes from 0 to 1048576\n";
+        return 1;
+    }
+    settings.readAhead = readAheadMegabytes << 20;
+
+    settings.notypes = parser.isSet(notypesOption);
+    settings.nodata = parser.isSet(nodataOption);
+    settings.printRawPointers = parser.isSet(printRawPointersOption);
+    settings.references = parser.isSet(referencesOption);
+    settings.streaming = parser.isSet(streamOption);
+    settings.buildIndex = parser.isSet(indexOption);
+    settings.statistics = parser.isSet(statsOption) || parser.isSet(statsJsonOption);
+    settings.summary = parser.isSet(summaryOption);
+    settings.headersOnly = parser.isSet(listOption);
+    settings.deduplication = parser.isSet(dedupPointersOption) ? BlendToXml::SameValues
+                           : parser.isSet(dedupOption) ? BlendToXml::SameBytes : BlendToXml::NoDeduplication;
+    if (settings.summary && (settings.buildIndex || parser.isSet(diffOption))) {
+        qerr << "summary: cannot be combined with --index or --diff\n";
+        return 1;
+    }
+    if (settings.headersOnly && (settings.buildIndex || settings.summary || parser.isSet(diffOption))) {
+        qerr << "list: cannot be combined with --index, --summary or --diff\n";
+        return 1;
+    }
+    settings.selection = parser.values(selectOption);
+    for (const QString &paths : parser.values(fieldsOption)) {
+        for (const QString &path : paths.split(',')) {
+            if (!path.trimmed().isEmpty()) {
+                settings.fields.append(path.trimmed());
+            }
+        }
+    }
+    for (const QString &paths : parser.values(extractOption)) {
+        for (const QString &path : paths.split(',')) {
+            if (!path.trimmed().isEmpty()) {
+                settings.extract.append(path.trimmed());
+            }
+        }
+    }
+    if (!parser.isSet(nocacheOption)) {
+        settings.cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    }
+
     QString outputPath = parser.value(outputOption);
 
-    QFile outFile;
+    if (parser.isSet(serveOption)) {
+        if (!args.isEmpty() || !outputPath.isEmpty() || !settings.extract.isEmpty() || settings.buildIndex || parser.isSet(diffOption)) {
+            qerr << "serve: expected no sources, without --output, --extract, --index or --diff\n";
+            return 1;
+        }
+        bool cacheSizeValid;
+        int cacheSize = parser.value(cacheSizeOption).toInt(&cacheSizeValid);
+        if (!cacheSizeValid || cacheSize < 1) {
+            qerr << "cache-size: expected a positive number\n";
+            return 1;
+        }
+
+        // Requests choose the blocks and the kind of document, the command
+        // line everything else
+        BlendServer server([&settings](QIODevice *out) {
+            BlendToXml *task = new BlendToXml(nullptr, out, settings.notypes, settings.nodata, settings.printRawPointers);
+            configure(task, settings, "-");
+            return task;
+        }, cacheSize);
+        server.setCachePath(settings.cachePath);
+
+        // A socket left behind by a server that did not shut down blocks
+        // listen(); it is only removed if no server answers on it
+        const QString name = parser.value(serveOption);
+        bool listening = server.listen(name);
+        if (!listening && server.serverError() == QAbstractSocket::AddressInUseError) {
+            QLocalSocket probe;
+            probe.connectToServer(name);
+            if (!probe.waitForConnected(1000)) {
+                QLocalServer::removeServer(name);
+                listening = server.listen(name);
+            }
+        }
+        if (!listening) {
+            qerr << QString("serve %1: %2\n").arg(name, server.errorString());
+            return 1;
+        }
+        return app.exec();
+    }
+
+    // Arrays go to files named after the source, even for a single one
+    if (!settings.extract.isEmpty()) {
+        if (args.contains("-") || settings.buildIndex || settings.summary || parser.isSet(diffOption)) {
+            qerr << "extract: expected source files, without --index, --summary or --diff\n";
+            return 1;
+        }
+        if (outputPath.isEmpty()) {
+            outputPath = "{dir}/{name}";
+        } else if (batch && !outputPath.contains("{name}")) {
+            qerr << "output: expected a template with {name} for several sources\n";
+            return 1;
+        }
+        return runBatch(args, outputPath, settings, parser.value(statsJsonOption), qerr);
+    }
+
+    if (parser.isSet(diffOption) && (batch || settings.format != BlendToXml::Xml || settings.buildIndex)) {
+        qerr << "diff: expected a single source and XML output\n";
+        return 1;
+    }
+
+    if (batch) {
+        if (outputPath.isEmpty()) {
+            QString suffix = settings.format == BlendToXml::MessagePack ? ".msgpack" : ".xml";
+            if (settings.compression == "gzip" || settings.compression == "zstd") {
+                suffix += settings.compression == "gzip" ? ".gz" : ".zst";
+            }
+            outputPath = (settings.summary ? "{dir}/{name}.summary" : "{dir}/{name}") + suffix;
+        } else if (!outputPath.contains("{name}")) {
+            qerr << "output: expected a template with {name} for several sources\n";
+            return 1;
+        }
+        return runBatch(args, outputPath, settings, parser.value(statsJsonOption), qerr);
+    }
 
-    if (outputPath.isEmpty()) {
-        outFile.open(stdout, QIODevice::WriteOnly);
+    QFile diffBase;
+    if (parser.isSet(diffOption)) {
+        diffBase.setFileName(parser.value(diffOption));
+        if (!diffBase.open(QIODevice::ReadOnly)) {
+            qerr << QString("open %1: %2\n").arg(diffBase.fileName(), diffBase.errorString());
+            return 1;
+        }
+    }
+
+    QFile file;
+    if (args[0] == "-") {
+        file.open(stdin, QIODevice::ReadOnly);
     } else {
-        outFile.setFileName(outputPath);
-        outFile.open(QIODevice::WriteOnly);
+        file.setFileName(args[0]);
+        file.open(QIODevice::ReadOnly);
+    }
+    if (file.error() != QFileDevice::NoError) {
+        qerr << QString("open %1: %2\n").arg(args[0], file.errorString());
+        return 1;
+    }
+
+    QFile outFile;
+
+    // --index only writes the sidecar, so an existing -o file is left alone
+    if (!settings.buildIndex) {
+        if (outputPath.isEmpty()) {
+            outFile.open(stdout, QIODevice::WriteOnly);
+        } else {
+            outFile.setFileName(outputPath);
+            outFile.open(QIODevice::WriteOnly);
+        }
     }
 
     if (outFile.error() != QFileDevice::NoError) {
@@ -82,13 +731,61 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    bool notypes = parser.isSet(notypesOption);
-    bool nodata = parser.isSet(nodataOption);
-    bool printRawPointers = parser.isSet(printRawPointersOption);
+    QIODevice *out = &outFile;
+    std::unique_ptr<CompressedOutput> compressed;
+    CompressedOutput::Format compression;
+    if (!settings.buildIndex && outputCompression(settings, outputPath, &compression)) {
+        compressed.reset(new CompressedOutput(&outFile, compression, settings.jobs));
+        if (!compressed->open(QIODevice::WriteOnly)) {
+            qerr << "compress: " << compressed->errorString() << "\n";
+            return 1;
+        }
+        out = compressed.get();
+    }
 
-    BlendToXml *task = new BlendToXml(&file, &outFile, notypes, nodata, printRawPointers);
+    BlendToXml *task = new BlendToXml(&file, out, settings.notypes, settings.nodata, settings.printRawPointers);
+    configure(task, settings, args[0]);
+    if (diffBase.isOpen()) {
+        task->setDiffBase(&diffBase);
+    }
     QObject::connect(task, &BlendToXml::finished, &app, &QCoreApplication::quit);
+
+    QElapsedTimer clock;
+    clock.start();
+    if (parser.isSet(statsOption)) {
+        QObject::connect(task, &BlendToXml::progress, [&](qint64 bytes, qint64 total) {
+            qerr << QString("blend2xml: %1 of %2 MB (%3%), %4 s\n")
+                    .arg(megabytes(bytes), 0, 'f', 1)
+                    .arg(megabytes(total), 0, 'f', 1)
+                    .arg(total ? bytes * 100 / total : 100)
+                    .arg(clock.elapsed() / 1000);
+            qerr.flush();
+        });
+    }
     QTimer::singleShot(0, task, SLOT(run()));
 
-    return app.exec();
+    int result = app.exec();
+
+    FileReport report = {};
+    report.source = args[0];
+    report.error = task->errorString();
+    report.timings = task->timings();
+    report.stats = task->statistics();
+    report.memory = memoryUsage();
+    if (parser.isSet(statsOption) && report.error.isEmpty()) {
+        printReport(qerr, report);
+    }
+    if (parser.isSet(statsJsonOption) && !writeReports(parser.value(statsJsonOption), QList<FileReport>() << report, qerr)) {
+        return 1;
+    }
+
+    if (!task->errorString().isEmpty()) {
+        qerr << args[0] << ": " << task->errorString() << "\n";
+        return 1;
+    }
+    if (compressed && !compressed->finish()) {
+        qerr << "compress: " << compressed->errorString() << "\n";
+        return 1;
+    }
+    return result;
 }
@@ -0,0 +1,38 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef MEMORYUSAGE_H
+#define MEMORYUSAGE_H
+
+#include <QtGlobal>
+
+/*
+ * Memory use of the whole process, read from the system and the C library
+ * without wrapping the allocator, so the number of allocations is not
+ * known. Values that cannot be read are -1.
+ */
+struct MemoryUsage
+{
+    qint64 peakResident; // highest resident set size so far, in bytes
+    qint64 heapInUse;    // bytes currently allocated with malloc()
+};
+
+MemoryUsage memoryUsage();
+
+#endif // MEMORYUSAGE_H
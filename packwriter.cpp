@@ -0,0 +1,172 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "packwriter.h"
+
+#include <algorithm>
+
+#include <QtEndian>
+#include <QIODevice>
+
+static const int BufferSize = 1 << 20;
+
+PackWriter::PackWriter(QIODevice *device)
+    : m_device(device), m_buffer(&m_ownBuffer)
+{
+    m_ownBuffer.reserve(BufferSize + 4096);
+}
+
+PackWriter::PackWriter(QByteArray *buffer)
+    : m_device(nullptr), m_buffer(buffer)
+{}
+
+PackWriter::~PackWriter()
+{
+    flush();
+}
+
+void PackWriter::writeNil()
+{
+    m_buffer->append(static_cast<char>(0xc0));
+}
+
+void PackWriter::writeBool(bool value)
+{
+    m_buffer->append(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void PackWriter::writeUInt(uint64_t value)
+{
+    if (value < 0x80) {
+        m_buffer->append(static_cast<char>(value));
+    } else if (value <= 0xff) {
+        writeBigEndian(0xcc, value, 1);
+    } else if (value <= 0xffff) {
+        writeBigEndian(0xcd, value, 2);
+    } else if (value <= 0xffffffff) {
+        writeBigEndian(0xce, value, 4);
+    } else {
+        writeBigEndian(0xcf, value, 8);
+    }
+}
+
+void PackWriter::writeString(const char *text, int len)
+{
+    writeHeader(static_cast<uint32_t>(len), 0xa0, 32, 0xd9);
+    m_buffer->append(text, len);
+}
+
+// Latin-1 text is already UTF-8 when it is ASCII, as SDNA names are
+void PackWriter::writeString(QLatin1String text)
+{
+    auto isAscii = [](char c) { return static_cast<uchar>(c) < 0x80; };
+    if (std::all_of(text.data(), text.data() + text.size(), isAscii)) {
+        writeString(text.data(), text.size());
+    } else {
+        writeString(QString(text).toUtf8());
+    }
+}
+
+void PackWriter::writeBinary(const char *data, int len)
+{
+    memcpy(appendBinary(len), data, static_cast<size_t>(len));
+}
+
+char *PackWriter::appendBinary(int len)
+{
+    // bin has no fix form, so bin8 is written even for the shortest data
+    writeHeader(static_cast<uint32_t>(len), 0, 0, 0xc4);
+    int pos = m_buffer->size();
+    m_buffer->resize(pos + len);
+    return m_buffer->data() + pos;
+}
+
+void PackWriter::writeArray(uint32_t count)
+{
+    flushIfFull();
+    if (count < 16) {
+        m_buffer->append(static_cast<char>(0x90 | count));
+    } else if (count <= 0xffff) {
+        writeBigEndian(0xdc, count, 2);
+    } else {
+        writeBigEndian(0xdd, count, 4);
+    }
+}
+
+void PackWriter::writeMap(uint32_t count)
+{
+    flushIfFull();
+    if (count < 16) {
+        m_buffer->append(static_cast<char>(0x80 | count));
+    } else if (count <= 0xffff) {
+        writeBigEndian(0xde, count, 2);
+    } else {
+        writeBigEndian(0xdf, count, 4);
+    }
+}
+
+void PackWriter::writeRaw(const QByteArray &data)
+{
+    if (m_device && m_buffer->size() + data.size() >= BufferSize) {
+        flush();
+        m_device->write(data);
+        return;
+    }
+    m_buffer->append(data);
+}
+
+void PackWriter::flush()
+{
+    if (m_device && !m_buffer->isEmpty()) {
+        m_device->write(*m_buffer);
+        m_buffer->resize(0);
+    }
+}
+
+/*
+ * Strings and binary data share the same layout: an optional fix form
+ * with the length in the type byte, then 8, 16 and 32 bit lengths.
+ */
+void PackWriter::writeHeader(uint32_t len, uchar fix, int fixLimit, uchar first)
+{
+    if (len < static_cast<uint32_t>(fixLimit)) {
+        m_buffer->append(static_cast<char>(fix | len));
+    } else if (len <= 0xff) {
+        writeBigEndian(first, len, 1);
+    } else if (len <= 0xffff) {
+        writeBigEndian(first + 1, len, 2);
+    } else {
+        writeBigEndian(first + 2, len, 4);
+    }
+}
+
+void PackWriter::writeBigEndian(uchar type, uint64_t value, int bytes)
+{
+    uchar data[9];
+    data[0] = type;
+    qToBigEndian<quint64>(value << (64 - 8 * bytes), data + 1);
+    m_buffer->append(reinterpret_cast<const char *>(data), 1 + bytes);
+}
+
+void PackWriter::flushIfFull()
+{
+    if (m_buffer->size() >= BufferSize) {
+        flush();
+    }
+}
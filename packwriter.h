@@ -0,0 +1,79 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef PACKWRITER_H
+#define PACKWRITER_H
+
+#include <cstring>
+#include <inttypes.h>
+
+#include <QByteArray>
+#include <QLatin1String>
+#include <QString>
+
+class QIODevice;
+
+/*
+ * Buffered MessagePack writer for the binary output format. Like
+ * XmlWriter it either writes to a device in large pieces or fills a
+ * byte array that is appended to the document later with writeRaw().
+ */
+class PackWriter
+{
+public:
+    explicit PackWriter(QIODevice *device);
+    explicit PackWriter(QByteArray *buffer);
+    ~PackWriter();
+
+    void writeNil();
+    void writeBool(bool value);
+    void writeUInt(uint64_t value);
+
+    void writeString(const char *text, int len);
+    void writeString(const char *text) { writeString(text, static_cast<int>(strlen(text))); }
+    void writeString(const QByteArray &text) { writeString(text.constData(), text.size()); }
+    void writeString(const QString &text) { writeString(text.toUtf8()); }
+    void writeString(QLatin1String text);
+
+    void writeBinary(const char *data, int len);
+
+    // Writes the header of a bin object and returns its uninitialised
+    // payload, which stays valid until the next write
+    char *appendBinary(int len);
+
+    // Containers are written as a header with the number of entries,
+    // followed by the entries themselves
+    void writeArray(uint32_t count);
+    void writeMap(uint32_t count);
+
+    void writeRaw(const QByteArray &data);
+
+    void flush();
+
+private:
+    QIODevice *m_device;
+    QByteArray m_ownBuffer;
+    QByteArray *m_buffer;
+
+    void writeHeader(uint32_t len, uchar fix, int fixLimit, uchar first);
+    void writeBigEndian(uchar type, uint64_t value, int bytes);
+    void flushIfFull();
+};
+
+#endif // PACKWRITER_H
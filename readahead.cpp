@@ -0,0 +1,142 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "readahead.h"
+#include "blenderror.h"
+
+#include <QMutexLocker>
+
+// Largest read that coalesces several blocks
+static const qint64 ExtentBytes = 4 << 20;
+// Bytes between two blocks that are read rather than skipped
+static const qint64 MaxGap = 64 << 10;
+
+ReadAhead::ReadAhead(const BlendFile &file, const QVector<Block> &blocks, qint64 depth)
+    : m_file(file), m_blocks(blocks), m_depth(depth), m_threaded(depth > 0 && !file.isInMemory()),
+      m_pending(0), m_readEnd(0), m_next(0), m_stop(false)
+{
+    if (m_threaded) {
+        setAutoDelete(false);
+        m_pool.setMaxThreadCount(1);
+        m_pool.start(this);
+    }
+}
+
+ReadAhead::~ReadAhead()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stop = true;
+        m_consumed.wakeAll();
+    }
+    m_pool.waitForDone();
+}
+
+QByteArray ReadAhead::next()
+{
+    const Block &block = m_blocks[m_next];
+    if (!m_threaded) {
+        m_next++;
+        return m_file.read(block.pos, block.size);
+    }
+
+    QMutexLocker locker(&m_mutex);
+    while (m_next >= m_readEnd && m_error.isEmpty()) {
+        m_read.wait(&m_mutex);
+    }
+    if (m_next >= m_readEnd) {
+        throw BlendError(m_error);
+    }
+
+    int i = 0;
+    while (m_extents[i].end <= m_next) {
+        i++;
+    }
+    const Extent &extent = m_extents[i];
+    if (extent.first == m_next) {
+        m_pending -= extent.data.size();
+        m_consumed.wakeAll();
+    }
+    m_next++;
+
+    // A truncated file yields a short block, as with a direct read
+    const qint64 offset = qMin<qint64>(block.pos - extent.pos, extent.data.size());
+    const qint64 len = qMin<qint64>(block.size, extent.data.size() - offset);
+    return QByteArray::fromRawData(extent.data.constData() + offset, static_cast<int>(len));
+}
+
+void ReadAhead::release(int block)
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_extents.isEmpty() && m_extents.first().end <= block) {
+        m_extents.removeFirst();
+    }
+}
+
+/*
+ * Runs on the reader thread. The consumer only reads the block list, and
+ * the input is not touched by any other thread while blocks are dumped.
+ */
+void ReadAhead::run()
+{
+    const qint64 extentBytes = qMin(ExtentBytes, m_depth);
+
+    for (int first = 0; first < m_blocks.length(); ) {
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_stop && m_pending >= m_depth) {
+                m_consumed.wait(&m_mutex);
+            }
+            if (m_stop) {
+                return;
+            }
+        }
+
+        Extent extent;
+        extent.pos = m_blocks[first].pos;
+        extent.first = first;
+        qint64 end = extent.pos + m_blocks[first].size;
+        int last = first + 1;
+        while (last < m_blocks.length()) {
+            const Block &block = m_blocks[last];
+            if (block.pos < end || block.pos - end > MaxGap || block.pos + block.size - extent.pos > extentBytes) {
+                break;
+            }
+            end = block.pos + block.size;
+            last++;
+        }
+        extent.end = last;
+
+        try {
+            extent.data = m_file.read(extent.pos, end - extent.pos);
+        } catch (const BlendError &error) {
+            QMutexLocker locker(&m_mutex);
+            m_error = error.message();
+            m_read.wakeAll();
+            return;
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_pending += extent.data.size();
+        m_extents.append(extent);
+        m_readEnd = last;
+        m_read.wakeAll();
+        first = last;
+    }
+}
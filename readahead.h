@@ -0,0 +1,82 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "blendfile.h"
+
+/*
+ * Hands out the data of a list of blocks in order. When the file is not
+ * in memory (compressed input, pipes and their spool file), a reader
+ * thread reads up to depth bytes ahead of the consumer, with neighbouring
+ * blocks coalesced into a few large reads, so that the I/O and the
+ * decompression overlap with formatting. Otherwise next() reads the block
+ * directly.
+ */
+class ReadAhead : private QRunnable
+{
+public:
+    ReadAhead(const BlendFile &file, const QVector<Block> &blocks, qint64 depth);
+    ~ReadAhead();
+
+    // Data of the next block, which stays valid until release() is called
+    // for a later block. Rethrows errors of the reader thread.
+    QByteArray next();
+
+    // Drops the data of the blocks before block
+    void release(int block);
+
+private:
+    // Adjacent blocks read at once
+    struct Extent
+    {
+        qint64 pos;
+        int first, end;
+        QByteArray data;
+    };
+
+    const BlendFile &m_file;
+    const QVector<Block> &m_blocks;
+    qint64 m_depth;
+    bool m_threaded;
+
+    QMutex m_mutex;
+    QWaitCondition m_read;
+    QWaitCondition m_consumed;
+    QList<Extent> m_extents;
+    qint64 m_pending;       // bytes of extents the consumer has not reached yet
+    int m_readEnd;          // blocks read so far
+    int m_next;             // next block handed out
+    bool m_stop;
+    QString m_error;
+    QThreadPool m_pool;
+
+    void run();
+};
+
+#endif // READAHEAD_H
@@ -0,0 +1,335 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "xmlwriter.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+#include <QIODevice>
+
+static const int BufferSize = 1 << 20;
+
+XmlWriter::XmlWriter(QIODevice *device)
+    : m_device(device), m_buffer(&m_ownBuffer),
+      m_inStartElement(false), m_lastWasStartElement(false), m_wroteSomething(false)
+{
+    m_ownBuffer.reserve(BufferSize + 4096);
+}
+
+XmlWriter::XmlWriter(QByteArray *buffer)
+    : m_device(nullptr), m_buffer(buffer),
+      m_inStartElement(false), m_lastWasStartElement(false), m_wroteSomething(false)
+{}
+
+XmlWriter::~XmlWriter()
+{
+    flush();
+}
+
+void XmlWriter::writeStartDocument()
+{
+    finishStartElement(false);
+    m_buffer->append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+}
+
+void XmlWriter::writeEndDocument()
+{
+    while (!m_tags.isEmpty()) {
+        writeEndElement();
+    }
+    m_buffer->append('\n');
+    flush();
+}
+
+void XmlWriter::writeStartElement(const QByteArray &name)
+{
+    if (!finishStartElement(false)) {
+        indent(m_tags.size());
+    }
+    m_buffer->append('<');
+    m_buffer->append(name);
+    m_tags.append(name);
+    m_inStartElement = m_lastWasStartElement = true;
+}
+
+void XmlWriter::writeEndElement()
+{
+    if (m_tags.isEmpty()) {
+        return;
+    }
+
+    // Nothing was written since the start tag, close it as empty
+    if (m_inStartElement) {
+        m_buffer->append("/>");
+        m_inStartElement = m_lastWasStartElement = false;
+        m_tags.removeLast();
+        flushIfFull();
+        return;
+    }
+
+    if (!finishStartElement(false) && !m_lastWasStartElement) {
+        indent(m_tags.size() - 1);
+    }
+    m_lastWasStartElement = false;
+    m_buffer->append("</");
+    m_buffer->append(m_tags.last());
+    m_buffer->append('>');
+    m_tags.removeLast();
+    flushIfFull();
+}
+
+void XmlWriter::writeAttribute(const char *name, const char *value, int len)
+{
+    m_buffer->append(' ');
+    m_buffer->append(name);
+    m_buffer->append("=\"");
+    writeEscaped(value, len, true);
+    m_buffer->append('"');
+}
+
+// Latin-1 text is already UTF-8 when it is ASCII, as SDNA names are
+void XmlWriter::writeAttribute(const char *name, QLatin1String value)
+{
+    auto isAscii = [](char c) { return static_cast<uchar>(c) < 0x80; };
+    if (std::all_of(value.data(), value.data() + value.size(), isAscii)) {
+        writeAttribute(name, value.data(), value.size());
+    } else {
+        writeAttribute(name, QString(value).toUtf8());
+    }
+}
+
+void XmlWriter::writeAttribute(const char *name, uint64_t value, int base)
+{
+    char text[64];
+    auto result = std::to_chars(text, text + sizeof(text), value, base);
+    writeAttribute(name, text, static_cast<int>(result.ptr - text));
+}
+
+void XmlWriter::writeCharacters(const char *text, int len)
+{
+    finishStartElement(true);
+    writeEscaped(text, len, false);
+}
+
+void XmlWriter::writeCharacters(const QString &text)
+{
+    QByteArray utf8 = text.toUtf8();
+    writeCharacters(utf8.constData(), utf8.size());
+}
+
+// Longest text of a single formatted value
+static const int MaxNumberLength = 2 + 64;
+
+// Values formatted per resize of the buffer by writeNumbers()
+static const int NumberRun = 4096;
+
+static inline char *formatNumber(char *p, uint64_t value, bool binary)
+{
+    if (binary) {
+        *p++ = '0';
+        *p++ = 'b';
+    }
+    return std::to_chars(p, p + 64, value, binary ? 2 : 10).ptr;
+}
+
+static inline char *formatNumber(char *p, double value, bool)
+{
+    // Matches QString::number(value): "%g" with 6 significant digits,
+    // except that Qt prints NaN without a sign
+    if (std::isnan(value)) {
+        memcpy(p, "nan", 3);
+        return p + 3;
+    }
+    return std::to_chars(p, p + 32, value, std::chars_format::general, 6).ptr;
+}
+
+template<typename T>
+static inline char *formatValue(char *p, T value, bool binary)
+{
+    typedef typename std::conditional<std::is_floating_point<T>::value, double, uint64_t>::type Wide;
+    return formatNumber(p, static_cast<Wide>(value), binary);
+}
+
+void XmlWriter::writeNumber(uint64_t value)
+{
+    char text[MaxNumberLength];
+    writeSafeCharacters(text, static_cast<int>(formatNumber(text, value, false) - text));
+}
+
+void XmlWriter::writeNumber(double value)
+{
+    char text[MaxNumberLength];
+    writeSafeCharacters(text, static_cast<int>(formatNumber(text, value, false) - text));
+}
+
+void XmlWriter::writeBinary(uint64_t value)
+{
+    char text[MaxNumberLength];
+    writeSafeCharacters(text, static_cast<int>(formatNumber(text, value, true) - text));
+}
+
+void XmlWriter::writeHex(uint64_t value)
+{
+    char text[16];
+    auto result = std::to_chars(text, text + sizeof(text), value, 16);
+    writeSafeCharacters(text, static_cast<int>(result.ptr - text));
+}
+
+template<typename T>
+void XmlWriter::writeNumbers(const T *values, int count, bool binary)
+{
+    if (count <= 0) {
+        return;
+    }
+    finishStartElement(true);
+
+    // Format straight into the output buffer, a bounded run at a time so
+    // that the space reserved for a long array cannot overflow
+    for (int first = 0; first < count; first += NumberRun) {
+        const int end = first + qMin(NumberRun, count - first);
+        const int pos = m_buffer->size();
+        m_buffer->resize(pos + (end - first) * (MaxNumberLength + 1));
+        char *begin = m_buffer->data() + pos;
+        char *p = begin;
+        if (first > 0) {
+            *p++ = ' ';
+        }
+        p = formatValue(p, values[first], binary);
+        for (int i = first + 1; i < end; i++) {
+            *p++ = ' ';
+            p = formatValue(p, values[i], binary);
+        }
+        m_buffer->resize(pos + static_cast<int>(p - begin));
+        flushIfFull();
+    }
+}
+
+template void XmlWriter::writeNumbers<quint8>(const quint8 *, int, bool);
+template void XmlWriter::writeNumbers<quint16>(const quint16 *, int, bool);
+template void XmlWriter::writeNumbers<quint32>(const quint32 *, int, bool);
+template void XmlWriter::writeNumbers<quint64>(const quint64 *, int, bool);
+template void XmlWriter::writeNumbers<float>(const float *, int, bool);
+template void XmlWriter::writeNumbers<double>(const double *, int, bool);
+
+void XmlWriter::enterElement(const QByteArray &name)
+{
+    m_tags.append(name);
+    m_inStartElement = m_lastWasStartElement = m_wroteSomething = false;
+}
+
+void XmlWriter::writeRaw(const QByteArray &xml)
+{
+    if (m_device && m_buffer->size() + xml.size() >= BufferSize) {
+        flush();
+        m_device->write(xml);
+        return;
+    }
+    m_buffer->append(xml);
+}
+
+void XmlWriter::flush()
+{
+    if (m_device && !m_buffer->isEmpty()) {
+        m_device->write(*m_buffer);
+        m_buffer->resize(0);
+    }
+}
+
+void XmlWriter::indent(int level)
+{
+    m_buffer->append('\n');
+    for (int i = level; i > 0; --i) {
+        m_buffer->append("    ", 4);
+    }
+}
+
+/*
+ * Same escaping as QXmlStreamWriter: markup characters become entities,
+ * whitespace only in attributes, and characters that are not allowed in
+ * XML (control characters, U+FFFE and U+FFFF) are dropped.
+ */
+void XmlWriter::writeEscaped(const char *text, int len, bool escapeWhitespace)
+{
+    const char *end = text + len;
+    const char *run = text;
+
+    for (const char *p = text; p < end; p++) {
+        uchar c = static_cast<uchar>(*p);
+        if (c > '>' && c != 0xEF) {
+            continue;
+        }
+
+        const char *replacement;
+        int skip = 1;
+        switch (c) {
+        case '<': replacement = "&lt;"; break;
+        case '>': replacement = "&gt;"; break;
+        case '&': replacement = "&amp;"; break;
+        case '"': replacement = "&quot;"; break;
+        case '\t':
+            if (!escapeWhitespace) {
+                continue;
+            }
+            replacement = "&#9;";
+            break;
+        case '\n':
+            if (!escapeWhitespace) {
+                continue;
+            }
+            replacement = "&#10;";
+            break;
+        case '\r':
+            if (!escapeWhitespace) {
+                continue;
+            }
+            replacement = "&#13;";
+            break;
+        case 0xEF:
+            if (end - p < 3 || static_cast<uchar>(p[1]) != 0xBF || static_cast<uchar>(p[2]) < 0xBE) {
+                continue;
+            }
+            replacement = "";
+            skip = 3;
+            break;
+        default:
+            if (c >= 0x20) {
+                continue;
+            }
+            replacement = "";
+            break;
+        }
+
+        m_buffer->append(run, static_cast<int>(p - run));
+        m_buffer->append(replacement);
+        p += skip - 1;
+        run = p + 1;
+    }
+
+    m_buffer->append(run, static_cast<int>(end - run));
+}
+
+void XmlWriter::flushIfFull()
+{
+    if (m_buffer->size() >= BufferSize) {
+        flush();
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#ifndef XMLWRITER_H
+#define XMLWRITER_H
+
+#include <cstring>
+#include <inttypes.h>
+
+#include <QByteArray>
+#include <QLatin1String>
+#include <QList>
+#include <QString>
+
+class QIODevice;
+
+/*
+ * Buffered UTF-8 XML writer for the data output. It produces the same
+ * bytes as QXmlStreamWriter with auto-formatting enabled, but works on
+ * UTF-8 directly, formats numbers without temporary strings and writes
+ * to the device in large pieces.
+ */
+class XmlWriter
+{
+public:
+    explicit XmlWriter(QIODevice *device);
+    explicit XmlWriter(QByteArray *buffer);
+    ~XmlWriter();
+
+    void writeStartDocument();
+    void writeEndDocument();
+
+    void writeStartElement(const QByteArray &name);
+    void writeStartElement(const QString &name) { writeStartElement(name.toUtf8()); }
+    void writeStartElement(const char *name) { writeStartElement(QByteArray(name)); }
+    void writeEndElement();
+
+    void writeAttribute(const char *name, const char *value, int len);
+    void writeAttribute(const char *name, const char *value) { writeAttribute(name, value, static_cast<int>(strlen(value))); }
+    void writeAttribute(const char *name, const QByteArray &value) { writeAttribute(name, value.constData(), value.size()); }
+    void writeAttribute(const char *name, const QString &value) { writeAttribute(name, value.toUtf8()); }
+    void writeAttribute(const char *name, QLatin1String value);
+    void writeAttribute(const char *name, uint64_t value, int base = 10);
+
+    // Escaped UTF-8 text
+    void writeCharacters(const char *text, int len);
+    void writeCharacters(const char *text) { writeCharacters(text, static_cast<int>(strlen(text))); }
+    void writeCharacters(const QString &text);
+
+    // Text that needs no escaping, such as numbers and fixed words
+    void writeSafeCharacters(const char *text, int len)
+    {
+        finishStartElement(true);
+        m_buffer->append(text, len);
+    }
+    void writeSafeCharacters(const char *text) { writeSafeCharacters(text, static_cast<int>(strlen(text))); }
+
+    // Text that needs no escaping, written by fill(char *begin) straight
+    // into the buffer. fill returns the end of the text, which may be up
+    // to maxLen bytes long.
+    template<typename F>
+    void fillSafeCharacters(int maxLen, F fill)
+    {
+        finishStartElement(true);
+        const int size = m_buffer->size();
+        m_buffer->resize(size + maxLen);
+        char *end = fill(m_buffer->data() + size);
+        m_buffer->resize(static_cast<int>(end - m_buffer->constData()));
+    }
+
+    void writeNumber(uint64_t value);
+    void writeNumber(double value);
+    void writeBinary(uint64_t value);
+    void writeHex(uint64_t value);
+
+    // Space separated values, integers in binary if requested. Defined for
+    // quint8, quint16, quint32, quint64, float and double.
+    template<typename T>
+    void writeNumbers(const T *values, int count, bool binary = false);
+
+    // Marks an element as opened by another writer, so that this one can
+    // continue the document in the middle of it.
+    void enterElement(const QByteArray &name);
+
+    // Appends XML produced by another writer without changing the state.
+    void writeRaw(const QByteArray &xml);
+
+    void flush();
+
+private:
+    QIODevice *m_device;
+    QByteArray m_ownBuffer;
+    QByteArray *m_buffer;
+    QList<QByteArray> m_tags;
+    bool m_inStartElement;
+    bool m_lastWasStartElement;
+    bool m_wroteSomething;
+
+    bool finishStartElement(bool contents)
+    {
+        bool hadSomethingWritten = m_wroteSomething;
+        m_wroteSomething = contents;
+        if (m_inStartElement) {
+            m_buffer->append('>');
+            m_inStartElement = false;
+        }
+        return hadSomethingWritten;
+    }
+
+    void indent(int level);
+    void writeEscaped(const char *text, int len, bool escapeWhitespace);
+    void flushIfFull();
+};
+
+#endif // XMLWRITER_H
@@ -0,0 +1,100 @@
+/*
+ * ***** BEGIN GPL LICENSE BLOCK *****
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***** END GPL LICENSE BLOCK *****
+ */
+
+#include "xxhash64.h"
+
+#include <QtEndian>
+
+static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t accumulate(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * Prime2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * Prime1;
+}
+
+static inline uint64_t mergeRound(uint64_t accumulator, uint64_t value)
+{
+    accumulator ^= accumulate(0, value);
+    return accumulator * Prime1 + Prime4;
+}
+
+uint64_t xxHash64(const void *data, size_t len, uint64_t seed)
+{
+    auto p = static_cast<const uchar *>(data);
+    const uchar *end = p + len;
+    uint64_t hash;
+
+    if (len >= 32) {
+        // Four independent lanes over 32 byte stripes
+        uint64_t v1 = seed + Prime1 + Prime2;
+        uint64_t v2 = seed + Prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - Prime1;
+        const uchar *limit = end - 32;
+        do {
+            v1 = accumulate(v1, qFromLittleEndian<quint64>(p));
+            v2 = accumulate(v2, qFromLittleEndian<quint64>(p + 8));
+            v3 = accumulate(v3, qFromLittleEndian<quint64>(p + 16));
+            v4 = accumulate(v4, qFromLittleEndian<quint64>(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    } else {
+        hash = seed + Prime5;
+    }
+
+    hash += len;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= accumulate(0, qFromLittleEndian<quint64>(p));
+        hash = rotateLeft(hash, 27) * Prime1 + Prime4;
+    }
+    if (p + 4 <= end) {
+        hash ^= static_cast<uint64_t>(qFromLittleEndian<quint32>(p)) * Prime1;
+        hash = rotateLeft(hash, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * Prime5;
+        hash = rotateLeft(hash, 11) * Prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+    return hash;
+}